@@ -0,0 +1,190 @@
+/*
+ *  Bruker.cpp
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "itkByteSwapper.h"
+#include "itkMetaDataObject.h"
+
+#include "Bruker.h"
+#include "Kernels.h"
+#include "Macro.h"
+#include "Util.h"
+
+/*
+ * visu_pars values can end up in the dictionary as either scalars or arrays
+ */
+static std::vector<double> GetNumbers(const itk::MetaDataDictionary &dict,
+                                      const std::string &            name,
+                                      const std::vector<double> &    def) {
+    std::vector<double> array_value;
+    double              double_value;
+    if (ExposeMetaData(dict, name, array_value) && array_value.size() > 0) {
+        return array_value;
+    } else if (ExposeMetaData(dict, name, double_value)) {
+        return {double_value};
+    } else {
+        return def;
+    }
+}
+
+/*
+ * The frame group names (FG_SLICE, FG_ECHO etc.) in VisuFGOrderDesc, first group varies fastest
+ */
+std::vector<std::string> GetFrameGroups(const itk::MetaDataDictionary &dict) {
+    std::vector<std::vector<std::string>> array_array_value;
+    std::vector<std::string>              array_value;
+    if (ExposeMetaData(dict, "VisuFGOrderDesc", array_array_value)) {
+        for (const auto &group : array_array_value) {
+            array_value.insert(array_value.end(), group.begin(), group.end());
+        }
+    } else if (!ExposeMetaData(dict, "VisuFGOrderDesc", array_value) &&
+               dict.HasKey("VisuFGOrderDesc")) {
+        FAIL("Could not read VisuFGOrderDesc");
+    }
+    std::vector<std::string> groups;
+    for (const auto &value : array_value) {
+        if (value.find("FG_") != std::string::npos) {
+            groups.push_back(value);
+        }
+    }
+    return groups;
+}
+
+Bruker2dseq::Bruker2dseq(itk::ImageIOBase *header) {
+    const auto &dict = header->GetMetaDataDictionary();
+
+    const std::string word_type =
+        GetMetaDataAsString(dict, "VisuCoreWordType", "_32BIT_SGN_INT");
+    if (word_type == "_8BIT_UNSGN_INT") {
+        m_word_type  = WordType::UInt8;
+        m_word_bytes = 1;
+    } else if (word_type == "_16BIT_SGN_INT") {
+        m_word_type  = WordType::Int16;
+        m_word_bytes = 2;
+    } else if (word_type == "_32BIT_SGN_INT") {
+        m_word_type  = WordType::Int32;
+        m_word_bytes = 4;
+    } else if (word_type == "_32BIT_FLOAT") {
+        m_word_type  = WordType::Float32;
+        m_word_bytes = 4;
+    } else {
+        FAIL("Unsupported VisuCoreWordType: " << word_type);
+    }
+
+    const bool file_big_endian =
+        GetMetaDataAsString(dict, "VisuCoreByteOrder", "littleEndian") == "bigEndian";
+    m_swap = file_big_endian != itk::ByteSwapper<int>::SystemIsBigEndian();
+    m_reverse_slices = GetMetaDataAsString(dict, "VisuCoreDiskSliceOrder", "") ==
+                       "disk_reverse_slice_order";
+
+    /* Volumes are only contiguous on disk if the slices are the fastest varying frame group */
+    const auto groups = GetFrameGroups(dict);
+    for (size_t g = 1; g < groups.size(); g++) {
+        if (groups[g].find("FG_SLICE") != std::string::npos) {
+            FAIL("Slices are not the first frame group (" << groups[0] << "), cannot read "
+                                                          << header->GetFileName() << " directly");
+        }
+    }
+
+    m_frame_pixels = 1;
+    for (const auto &s : GetNumbers(dict, "VisuCoreSize", {})) {
+        m_frame_pixels *= static_cast<size_t>(s);
+    }
+
+    const auto dims = header->GetNumberOfDimensions();
+    m_volume_pixels = 1;
+    for (unsigned int i = 0; i < std::min(dims, 3u); i++) {
+        m_volume_pixels *= header->GetDimensions(i);
+    }
+    m_volumes = 1;
+    for (unsigned int i = 3; i < dims; i++) {
+        m_volumes *= header->GetDimensions(i);
+    }
+    if (m_frame_pixels == 0 || (m_volume_pixels % m_frame_pixels) != 0) {
+        FAIL("VisuCoreSize does not match image dimensions in: " << header->GetFileName());
+    }
+    m_frames_per_volume = m_volume_pixels / m_frame_pixels;
+
+    m_slopes  = GetNumbers(dict, "VisuCoreDataSlope", {1.0});
+    m_offsets = GetNumbers(dict, "VisuCoreDataOffs", {0.0});
+
+    m_fd = open(header->GetFileName(), O_RDONLY);
+    if (m_fd < 0) {
+        FAIL("Could not open: " << header->GetFileName());
+    }
+    struct stat info;
+    if (fstat(m_fd, &info) != 0) {
+        FAIL("Could not stat: " << header->GetFileName());
+    }
+    if (static_cast<size_t>(info.st_size) < m_volumes * m_volume_pixels * m_word_bytes) {
+        FAIL("2dseq file is too short for the image dimensions: " << header->GetFileName());
+    }
+    m_path = header->GetFileName();
+}
+
+Bruker2dseq::~Bruker2dseq() {
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+template <typename T>
+void Bruker2dseq::ReadFrame(const size_t frame, const unsigned char *in, T *out) const {
+    const double slope  = m_slopes[std::min(frame, m_slopes.size() - 1)];
+    const double offset = m_offsets[std::min(frame, m_offsets.size() - 1)];
+    switch (m_word_type) {
+    case WordType::UInt8:
+        Kernels::ConvertScaled<uint8_t>(in, m_frame_pixels, m_swap, slope, offset, out);
+        break;
+    case WordType::Int16:
+        Kernels::ConvertScaled<int16_t>(in, m_frame_pixels, m_swap, slope, offset, out);
+        break;
+    case WordType::Int32:
+        Kernels::ConvertScaled<int32_t>(in, m_frame_pixels, m_swap, slope, offset, out);
+        break;
+    case WordType::Float32:
+        Kernels::ConvertScaled<float>(in, m_frame_pixels, m_swap, slope, offset, out);
+        break;
+    }
+}
+
+template <typename T> void Bruker2dseq::ReadVolume(const size_t v, T *out) const {
+    if (v >= m_volumes) {
+        FAIL("Requested volume " << v << " but 2dseq only contains " << m_volumes);
+    }
+    /* Read the raw volume into the scratch buffer, pread may return less than was asked for */
+    const size_t frame_bytes  = m_frame_pixels * m_word_bytes;
+    const size_t volume_bytes = m_frames_per_volume * frame_bytes;
+    m_buffer.resize(volume_bytes);
+    size_t done = 0;
+    while (done < volume_bytes) {
+        const ssize_t n =
+            pread(m_fd, m_buffer.data() + done, volume_bytes - done, v * volume_bytes + done);
+        if (n <= 0) {
+            FAIL("Failed to read volume " << v << " from: " << m_path);
+        }
+        done += static_cast<size_t>(n);
+    }
+    for (size_t s = 0; s < m_frames_per_volume; s++) {
+        const size_t disk_s = m_reverse_slices ? (m_frames_per_volume - 1 - s) : s;
+        ReadFrame(v * m_frames_per_volume + disk_s,
+                  m_buffer.data() + disk_s * frame_bytes,
+                  out + s * m_frame_pixels);
+    }
+}
+
+template void Bruker2dseq::ReadVolume<float>(const size_t v, float *out) const;
+template void Bruker2dseq::ReadVolume<double>(const size_t v, double *out) const;
@@ -0,0 +1,70 @@
+/*
+ *  Bruker.h
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Direct access to the frames of a Bruker 2dseq file. ITK's reader always loads the whole
+ *  dataset, this allows large series to be converted a volume at a time instead. Each volume is
+ *  read with pread into a raw scratch buffer and converted into the destination buffer, so memory
+ *  use is bounded by the volumes being converted rather than the size of the file.
+ *
+ */
+
+#ifndef BRUKER_H
+#define BRUKER_H
+
+#include <string>
+#include <vector>
+
+#include "itkImageIOBase.h"
+
+/*
+ * The frame group names (FG_SLICE, FG_ECHO etc.) in VisuFGOrderDesc, first group varies fastest.
+ * Empty if the header has no VisuFGOrderDesc.
+ */
+std::vector<std::string> GetFrameGroups(const itk::MetaDataDictionary &dict);
+
+class Bruker2dseq {
+  public:
+    /*
+     * The header must be an ImageIO that has already read the image information for the 2dseq
+     * file, so that visu_pars is available in the meta-data dictionary. Fails if the slices are
+     * not the first frame group in VisuFGOrderDesc (e.g. some multi-echo data), because then the
+     * frames of a volume are not contiguous on disk.
+     */
+    Bruker2dseq(itk::ImageIOBase *header);
+    ~Bruker2dseq();
+    Bruker2dseq(const Bruker2dseq &) = delete;
+    Bruker2dseq &operator=(const Bruker2dseq &) = delete;
+
+    size_t VolumePixels() const { return m_volume_pixels; } //!< Pixels in one 3D volume
+    size_t Volumes() const { return m_volumes; }            //!< Number of volumes in the file
+
+    /*
+     * Read volume v into out (which must hold VolumePixels() values), applying byte-swapping and
+     * the per-frame slope and offset. Slices stored in reverse order (VisuCoreDiskSliceOrder)
+     * are returned in ascending order. Not thread-safe, volumes share one scratch buffer.
+     */
+    template <typename T> void ReadVolume(size_t v, T *out) const;
+
+  private:
+    enum class WordType { UInt8, Int16, Int32, Float32 };
+
+    int                                m_fd = -1;
+    std::string                        m_path;
+    mutable std::vector<unsigned char> m_buffer; // One raw volume
+    WordType                           m_word_type;
+    size_t                             m_word_bytes;
+    bool                               m_swap;
+    bool                               m_reverse_slices;
+    size_t m_frame_pixels, m_frames_per_volume, m_volume_pixels, m_volumes;
+    std::vector<double> m_slopes, m_offsets;
+
+    template <typename T> void ReadFrame(size_t frame, const unsigned char *in, T *out) const;
+};
+
+#endif // BRUKER_H
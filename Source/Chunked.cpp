@@ -0,0 +1,376 @@
+/*
+ *  Chunked.cpp
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Contains template definitions and explicit instantiations (see note in IO.h)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <complex>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkImageScanlineIterator.h"
+#include "itkMultiThreaderBase.h"
+#include "itk_zlib.h"
+
+#include "Chunked.h"
+#include "Macro.h"
+
+static const char     chunk_magic[8] = {'N', 'A', 'N', 'C', 'H', 'U', 'N', 'K'};
+static const uint32_t chunk_version  = 1;
+
+template <typename T> struct PixelCode;
+template <> struct PixelCode<float> { static constexpr uint32_t value = 1; };
+template <> struct PixelCode<double> { static constexpr uint32_t value = 2; };
+template <> struct PixelCode<std::complex<float>> { static constexpr uint32_t value = 3; };
+template <> struct PixelCode<std::complex<double>> { static constexpr uint32_t value = 4; };
+
+template <typename T> static void Put(std::ostream &os, const T &value) {
+    os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> static T Get(std::istream &is) {
+    T value;
+    is.read(reinterpret_cast<char *>(&value), sizeof(T));
+    if (!is) {
+        FAIL("Unexpected end of chunked file header");
+    }
+    return value;
+}
+
+/*
+ * Everything before the chunk data
+ */
+struct ChunkIndex {
+    uint32_t              pixel, dims;
+    std::vector<uint64_t> size, chunk, grid, offsets, bytes;
+    std::vector<double>   spacing, origin, direction;
+};
+
+static ChunkIndex ReadIndex(std::istream &file, const std::string &path) {
+    char magic[8];
+    file.read(magic, 8);
+    if (!file || !std::equal(magic, magic + 8, chunk_magic)) {
+        FAIL("Not a chunked image: " << path);
+    }
+    if (Get<uint32_t>(file) != chunk_version) {
+        FAIL("Unsupported chunked image version: " << path);
+    }
+    ChunkIndex index;
+    index.pixel = Get<uint32_t>(file);
+    index.dims  = Get<uint32_t>(file);
+    for (uint32_t d = 0; d < index.dims; d++) {
+        index.size.push_back(Get<uint64_t>(file));
+    }
+    for (uint32_t d = 0; d < index.dims; d++) {
+        index.chunk.push_back(Get<uint64_t>(file));
+        if (index.chunk.back() == 0) {
+            FAIL("Invalid chunk size in: " << path);
+        }
+        index.grid.push_back((index.size[d] + index.chunk[d] - 1) / index.chunk[d]);
+    }
+    for (uint32_t d = 0; d < index.dims; d++) {
+        index.spacing.push_back(Get<double>(file));
+    }
+    for (uint32_t d = 0; d < index.dims; d++) {
+        index.origin.push_back(Get<double>(file));
+    }
+    for (uint32_t d = 0; d < index.dims * index.dims; d++) {
+        index.direction.push_back(Get<double>(file));
+    }
+    const uint64_t n_chunks = Get<uint64_t>(file);
+    for (uint64_t c = 0; c < n_chunks; c++) {
+        index.offsets.push_back(Get<uint64_t>(file));
+    }
+    for (uint64_t c = 0; c < n_chunks; c++) {
+        index.bytes.push_back(Get<uint64_t>(file));
+    }
+    return index;
+}
+
+bool IsChunked(const std::string &path) {
+    const std::string ext = ".nch";
+    return path.size() > ext.size() &&
+           path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+template <typename TImg>
+void WriteChunked(const TImg *ptr, const std::string &path, const size_t chunk_slices) {
+    using TPixel             = typename TImg::PixelType;
+    constexpr unsigned int D = TImg::ImageDimension;
+    const auto             region = ptr->GetLargestPossibleRegion();
+    if (ptr->GetBufferedRegion() != region) {
+        FAIL("Can only write a chunked image from a fully buffered image: " << path);
+    }
+
+    /* Chunks are slabs of whole slices within one volume, so that each one is contiguous */
+    const auto            size = region.GetSize();
+    std::vector<uint64_t> chunk(D, 1), grid(D), stride(D);
+    uint64_t              n_chunks = 1, pixels = 1;
+    for (unsigned int d = 0; d < D; d++) {
+        if (d < 2) {
+            chunk[d] = size[d];
+        } else if (d == 2) {
+            chunk[d] = std::min<uint64_t>(std::max<size_t>(chunk_slices, 1), size[d]);
+        }
+        grid[d]   = (size[d] + chunk[d] - 1) / chunk[d];
+        stride[d] = pixels;
+        pixels *= size[d];
+        n_chunks *= grid[d];
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        FAIL("Could not open for writing: " << path);
+    }
+    file.write(chunk_magic, 8);
+    Put(file, chunk_version);
+    Put(file, PixelCode<TPixel>::value);
+    Put(file, static_cast<uint32_t>(D));
+    for (unsigned int d = 0; d < D; d++) {
+        Put(file, static_cast<uint64_t>(size[d]));
+    }
+    for (unsigned int d = 0; d < D; d++) {
+        Put(file, chunk[d]);
+    }
+    for (unsigned int d = 0; d < D; d++) {
+        Put(file, static_cast<double>(ptr->GetSpacing()[d]));
+    }
+    for (unsigned int d = 0; d < D; d++) {
+        Put(file, static_cast<double>(ptr->GetOrigin()[d]));
+    }
+    for (unsigned int i = 0; i < D; i++) {
+        for (unsigned int j = 0; j < D; j++) {
+            Put(file, static_cast<double>(ptr->GetDirection()(i, j)));
+        }
+    }
+    Put(file, n_chunks);
+    /* The index is filled in once the compressed sizes are known */
+    const auto            index_position = file.tellp();
+    std::vector<uint64_t> offsets(n_chunks), bytes(n_chunks);
+    file.write(reinterpret_cast<const char *>(offsets.data()), n_chunks * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char *>(bytes.data()), n_chunks * sizeof(uint64_t));
+
+    /* Compress a batch of chunks in parallel and write it before starting the next one, so that
+     * only one batch of compressed data is held at a time */
+    const uint64_t batch =
+        std::max<uint64_t>(itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads(), 1);
+    std::vector<std::vector<Bytef>> compressed(std::min(batch, n_chunks));
+    std::atomic<bool>               failed(false);
+    const TPixel *const             data     = ptr->GetBufferPointer();
+    auto                            threader = itk::MultiThreaderBase::New();
+    for (uint64_t first = 0; first < n_chunks; first += batch) {
+        const uint64_t count = std::min(batch, n_chunks - first);
+        threader->ParallelizeArray(
+            0,
+            count,
+            [&](const itk::SizeValueType i) {
+                /* Chunks are numbered x fastest, like the pixels */
+                uint64_t c = first + i, offset = 0, chunk_pixels = 1;
+                for (unsigned int d = 0; d < D; d++) {
+                    const uint64_t start = (c % grid[d]) * chunk[d];
+                    c /= grid[d];
+                    offset += start * stride[d];
+                    chunk_pixels *= std::min(chunk[d], size[d] - start);
+                }
+                const uLong src_bytes = chunk_pixels * sizeof(TPixel);
+                uLongf      dst_bytes = compressBound(src_bytes);
+                compressed[i].resize(dst_bytes);
+                if (compress2(compressed[i].data(),
+                              &dst_bytes,
+                              reinterpret_cast<const Bytef *>(data + offset),
+                              src_bytes,
+                              Z_DEFAULT_COMPRESSION) != Z_OK) {
+                    failed = true;
+                }
+                compressed[i].resize(dst_bytes);
+            },
+            nullptr);
+        if (failed) {
+            FAIL("Failed to compress chunks for: " << path);
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            offsets[first + i] = static_cast<uint64_t>(file.tellp());
+            bytes[first + i]   = compressed[i].size();
+            file.write(reinterpret_cast<const char *>(compressed[i].data()), compressed[i].size());
+        }
+    }
+    file.seekp(index_position);
+    file.write(reinterpret_cast<const char *>(offsets.data()), n_chunks * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char *>(bytes.data()), n_chunks * sizeof(uint64_t));
+    if (!file) {
+        FAIL("Failed to write: " << path);
+    }
+}
+
+template <typename TImg>
+auto ReadChunkedRegion(const std::string &path, const typename TImg::RegionType &region) ->
+    typename TImg::Pointer {
+    using TPixel             = typename TImg::PixelType;
+    constexpr unsigned int D = TImg::ImageDimension;
+    std::ifstream          file(path, std::ios::binary);
+    if (!file) {
+        FAIL("Could not open: " << path);
+    }
+    const ChunkIndex index = ReadIndex(file, path);
+    if (index.pixel != PixelCode<TPixel>::value || index.dims != D) {
+        FAIL("Pixel type or dimension of " << path << " does not match the requested image");
+    }
+
+    typename TImg::SizeType      size;
+    typename TImg::SpacingType   spacing;
+    typename TImg::PointType     origin;
+    typename TImg::DirectionType direction;
+    for (unsigned int i = 0; i < D; i++) {
+        size[i]    = index.size[i];
+        spacing[i] = index.spacing[i];
+        origin[i]  = index.origin[i];
+        for (unsigned int j = 0; j < D; j++) {
+            direction(i, j) = index.direction[i * D + j];
+        }
+    }
+    const typename TImg::RegionType largest(size);
+    if (!largest.IsInside(region)) {
+        FAIL("Requested region is outside the image in: " << path);
+    }
+    auto image = TImg::New();
+    image->SetLargestPossibleRegion(largest);
+    image->SetBufferedRegion(region);
+    image->SetRequestedRegion(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+    image->Allocate();
+
+    /* Find the chunks that overlap the region, and read only those */
+    typename TImg::IndexType first, last;
+    for (unsigned int d = 0; d < D; d++) {
+        first[d] = region.GetIndex(d) / index.chunk[d];
+        last[d]  = (region.GetIndex(d) + region.GetSize(d) - 1) / index.chunk[d];
+    }
+    std::vector<typename TImg::RegionType> chunk_regions;
+    std::vector<std::vector<Bytef>>        compressed;
+    typename TImg::IndexType               c = first;
+    while (true) {
+        uint64_t                  linear = 0, stride = 1;
+        typename TImg::RegionType chunk_region;
+        for (unsigned int d = 0; d < D; d++) {
+            linear += c[d] * stride;
+            stride *= index.grid[d];
+            chunk_region.SetIndex(d, c[d] * index.chunk[d]);
+            chunk_region.SetSize(d,
+                                 std::min(index.chunk[d], index.size[d] - c[d] * index.chunk[d]));
+        }
+        if (linear >= index.offsets.size()) {
+            FAIL("Chunk index is incomplete in: " << path);
+        }
+        chunk_regions.push_back(chunk_region);
+        compressed.emplace_back(index.bytes[linear]);
+        file.seekg(index.offsets[linear]);
+        file.read(reinterpret_cast<char *>(compressed.back().data()), index.bytes[linear]);
+        if (!file) {
+            FAIL("Failed to read chunk " << linear << " from: " << path);
+        }
+
+        unsigned int d = 0;
+        while (d < D && c[d] == last[d]) {
+            c[d] = first[d];
+            d++;
+        }
+        if (d == D) {
+            break;
+        }
+        c[d]++;
+    }
+
+    /* Decompress in parallel, the chunks do not overlap so each one can be copied independently */
+    std::atomic<bool> failed(false);
+    auto              threader = itk::MultiThreaderBase::New();
+    threader->ParallelizeArray(
+        0,
+        chunk_regions.size(),
+        [&](const itk::SizeValueType i) {
+            const auto &        chunk_region = chunk_regions[i];
+            const uLong         n            = chunk_region.GetNumberOfPixels();
+            uLongf              bytes        = n * sizeof(TPixel);
+            std::vector<TPixel> pixels(n);
+            if (uncompress(reinterpret_cast<Bytef *>(pixels.data()),
+                           &bytes,
+                           compressed[i].data(),
+                           compressed[i].size()) != Z_OK ||
+                bytes != n * sizeof(TPixel)) {
+                failed = true;
+                return;
+            }
+            auto overlap = chunk_region;
+            overlap.Crop(region);
+            itk::ImageScanlineIterator<TImg> it(image, overlap);
+            while (!it.IsAtEnd()) {
+                const auto pixel_index = it.GetIndex();
+                size_t     offset = 0, stride = 1;
+                for (unsigned int d = 0; d < D; d++) {
+                    offset += (pixel_index[d] - chunk_region.GetIndex(d)) * stride;
+                    stride *= chunk_region.GetSize(d);
+                }
+                std::copy_n(pixels.data() + offset, overlap.GetSize(0), &it.Value());
+                it.NextLine();
+            }
+        },
+        nullptr);
+    if (failed) {
+        FAIL("Failed to decompress chunks from: " << path);
+    }
+    return image;
+}
+
+template <typename TImg> auto ReadChunked(const std::string &path) -> typename TImg::Pointer {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        FAIL("Could not open: " << path);
+    }
+    const ChunkIndex          index = ReadIndex(file, path);
+    typename TImg::RegionType region;
+    if (index.dims != TImg::ImageDimension) {
+        FAIL("Dimension of " << path << " does not match the requested image");
+    }
+    for (unsigned int d = 0; d < TImg::ImageDimension; d++) {
+        region.SetSize(d, index.size[d]);
+    }
+    return ReadChunkedRegion<TImg>(path, region);
+}
+
+template void WriteChunked<itk::Image<float, 2u>>(const itk::Image<float, 2u> *ptr, const std::string &path, size_t chunk_slices);
+template void WriteChunked<itk::Image<float, 3u>>(const itk::Image<float, 3u> *ptr, const std::string &path, size_t chunk_slices);
+template void WriteChunked<itk::Image<float, 4u>>(const itk::Image<float, 4u> *ptr, const std::string &path, size_t chunk_slices);
+template void WriteChunked<itk::Image<double, 2u>>(const itk::Image<double, 2u> *ptr, const std::string &path, size_t chunk_slices);
+template void WriteChunked<itk::Image<double, 3u>>(const itk::Image<double, 3u> *ptr, const std::string &path, size_t chunk_slices);
+template void WriteChunked<itk::Image<double, 4u>>(const itk::Image<double, 4u> *ptr, const std::string &path, size_t chunk_slices);
+template void WriteChunked<itk::Image<std::complex<float>, 4u>>(const itk::Image<std::complex<float>, 4u> *ptr, const std::string &path, size_t chunk_slices);
+template void WriteChunked<itk::Image<std::complex<double>, 4u>>(const itk::Image<std::complex<double>, 4u> *ptr, const std::string &path, size_t chunk_slices);
+
+template auto ReadChunked<itk::Image<float, 2u>>(const std::string &path) -> itk::Image<float, 2u>::Pointer;
+template auto ReadChunked<itk::Image<float, 3u>>(const std::string &path) -> itk::Image<float, 3u>::Pointer;
+template auto ReadChunked<itk::Image<float, 4u>>(const std::string &path) -> itk::Image<float, 4u>::Pointer;
+template auto ReadChunked<itk::Image<double, 2u>>(const std::string &path) -> itk::Image<double, 2u>::Pointer;
+template auto ReadChunked<itk::Image<double, 3u>>(const std::string &path) -> itk::Image<double, 3u>::Pointer;
+template auto ReadChunked<itk::Image<double, 4u>>(const std::string &path) -> itk::Image<double, 4u>::Pointer;
+template auto ReadChunked<itk::Image<std::complex<float>, 4u>>(const std::string &path) -> itk::Image<std::complex<float>, 4u>::Pointer;
+template auto ReadChunked<itk::Image<std::complex<double>, 4u>>(const std::string &path) -> itk::Image<std::complex<double>, 4u>::Pointer;
+
+template auto ReadChunkedRegion<itk::Image<float, 2u>>(const std::string &path, const itk::Image<float, 2u>::RegionType &region) -> itk::Image<float, 2u>::Pointer;
+template auto ReadChunkedRegion<itk::Image<float, 3u>>(const std::string &path, const itk::Image<float, 3u>::RegionType &region) -> itk::Image<float, 3u>::Pointer;
+template auto ReadChunkedRegion<itk::Image<float, 4u>>(const std::string &path, const itk::Image<float, 4u>::RegionType &region) -> itk::Image<float, 4u>::Pointer;
+template auto ReadChunkedRegion<itk::Image<double, 2u>>(const std::string &path, const itk::Image<double, 2u>::RegionType &region) -> itk::Image<double, 2u>::Pointer;
+template auto ReadChunkedRegion<itk::Image<double, 3u>>(const std::string &path, const itk::Image<double, 3u>::RegionType &region) -> itk::Image<double, 3u>::Pointer;
+template auto ReadChunkedRegion<itk::Image<double, 4u>>(const std::string &path, const itk::Image<double, 4u>::RegionType &region) -> itk::Image<double, 4u>::Pointer;
+template auto ReadChunkedRegion<itk::Image<std::complex<float>, 4u>>(const std::string &path, const itk::Image<std::complex<float>, 4u>::RegionType &region) -> itk::Image<std::complex<float>, 4u>::Pointer;
+template auto ReadChunkedRegion<itk::Image<std::complex<double>, 4u>>(const std::string &path, const itk::Image<std::complex<double>, 4u>::RegionType &region) -> itk::Image<std::complex<double>, 4u>::Pointer;
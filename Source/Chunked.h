@@ -0,0 +1,48 @@
+/*
+ *  Chunked.h
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  A simple chunked image format (.nch). Each chunk is a slab of whole slices from one volume
+ *  (chunk_slices along z, by default one slice), so it is contiguous in memory and is compressed
+ *  independently. The index at the start of the file is filled in after the chunks are written.
+ *  A sub-region can then be read by decompressing only the chunks that overlap it, instead of
+ *  the whole file as with .nii.gz.
+ *
+ *  Layout (native byte order, which is little-endian on all supported platforms):
+ *      char     magic[8]                "NANCHUNK"
+ *      uint32   version, pixel type, dimensions (D)
+ *      uint64   size[D], chunk size[D]
+ *      double   spacing[D], origin[D], direction[D*D]
+ *      uint64   number of chunks (N)
+ *      uint64   offset[N], compressed bytes[N]
+ *      chunks, each one a zlib stream of the pixels in the chunk, x fastest
+ *
+ *  Templates are explicitly instantiated in Chunked.cpp, see the note in IO.h.
+ *
+ */
+
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <string>
+
+bool IsChunked(const std::string &path); //!< Does the path have the chunked format extension?
+
+template <typename TImg>
+extern void WriteChunked(const TImg *ptr, const std::string &path, size_t chunk_slices = 1);
+
+template <typename TImg> extern auto ReadChunked(const std::string &path) -> typename TImg::Pointer;
+
+/*
+ * Read only the chunks that overlap region. The returned image has region as its buffered region.
+ */
+template <typename TImg>
+extern auto ReadChunkedRegion(const std::string &path, const typename TImg::RegionType &region) ->
+    typename TImg::Pointer;
+
+#endif // CHUNKED_H
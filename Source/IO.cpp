@@ -11,12 +11,16 @@
  */
 
 #include "IO.h"
+#include "Chunked.h"
 #include "Macro.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 
 template<typename TImg>
 auto ReadImage(const std::string &path) -> typename TImg::Pointer {
+    if (IsChunked(path)) {
+        return ReadChunked<TImg>(path);
+    }
     typedef itk::ImageFileReader<TImg> TReader;
     typename TReader::Pointer file = TReader::New();
     file->SetFileName(path);
@@ -38,6 +42,10 @@ template auto ReadImage<itk::Image<double, 4u>>(const std::string &path) -> itk:
 
 template<typename TImg>
 void WriteImage(const TImg *ptr, const std::string &path) {
+    if (IsChunked(path)) {
+        WriteChunked<TImg>(ptr, path);
+        return;
+    }
     typedef itk::ImageFileWriter<TImg> TWriter;
     typename TWriter::Pointer file = TWriter::New();
     file->SetFileName(path);
@@ -0,0 +1,140 @@
+/*
+ *  Kernels.h
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Pixel conversion kernels. These are written as simple branch-free loops over contiguous
+ *  buffers so that the compiler can vectorise them, and do the byte-swap, widening and
+ *  slope/offset scaling in a single pass over the data. The loops are marked omp simd, and the
+ *  build adds -fopenmp-simd where supported, so that they also vectorise at -O2.
+ *
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <algorithm>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace Kernels {
+
+template <size_t N> struct UnsignedOfSize;
+template <> struct UnsignedOfSize<1> { using type = uint8_t; };
+template <> struct UnsignedOfSize<2> { using type = uint16_t; };
+template <> struct UnsignedOfSize<4> { using type = uint32_t; };
+template <> struct UnsignedOfSize<8> { using type = uint64_t; };
+
+inline uint8_t  ByteSwapBits(uint8_t x) { return x; }
+#if defined(__GNUC__) || defined(__clang__)
+inline uint16_t ByteSwapBits(uint16_t x) { return __builtin_bswap16(x); }
+inline uint32_t ByteSwapBits(uint32_t x) { return __builtin_bswap32(x); }
+inline uint64_t ByteSwapBits(uint64_t x) { return __builtin_bswap64(x); }
+#else
+inline uint16_t ByteSwapBits(uint16_t x) { return static_cast<uint16_t>((x >> 8) | (x << 8)); }
+inline uint32_t ByteSwapBits(uint32_t x) {
+    return ((x & 0xFF000000u) >> 24) | ((x & 0x00FF0000u) >> 8) | ((x & 0x0000FF00u) << 8) |
+           ((x & 0x000000FFu) << 24);
+}
+inline uint64_t ByteSwapBits(uint64_t x) {
+    return (static_cast<uint64_t>(ByteSwapBits(static_cast<uint32_t>(x))) << 32) |
+           ByteSwapBits(static_cast<uint32_t>(x >> 32));
+}
+#endif
+
+/*
+ * Load a value from a possibly unaligned address, optionally reversing the bytes
+ */
+template <typename T, bool Swap> inline T Load(const unsigned char *p) {
+    using U = typename UnsignedOfSize<sizeof(T)>::type;
+    U bits;
+    std::memcpy(&bits, p, sizeof(T));
+    if (Swap) {
+        bits = ByteSwapBits(bits);
+    }
+    T value;
+    std::memcpy(&value, &bits, sizeof(T));
+    return value;
+}
+
+template <typename T> struct RealType { using type = T; };
+template <typename T> struct RealType<std::complex<T>> { using type = T; };
+
+template <typename TIn, typename TOut, bool Swap>
+void ConvertScaledImpl(const unsigned char *in,
+                       const size_t         n,
+                       const double         slope,
+                       const double         offset,
+                       TOut *const          out) {
+    /* Scale in double and round once when storing, as ITK does. Complex outputs get a real value */
+    using TReal = typename RealType<TOut>::type;
+#pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        const double value = static_cast<double>(Load<TIn, Swap>(in + i * sizeof(TIn)));
+        out[i]             = static_cast<TReal>(value * slope + offset);
+    }
+}
+
+/*
+ * Compilers turn a 32-bit byte-swap into a scalar bswap, which does not vectorise on targets
+ * without a byte shuffle (e.g. baseline x86-64). Instead, swap the bytes within each 16-bit half
+ * of a block in one pass, then swap the halves while converting. Both loops vectorise.
+ */
+template <typename TIn, typename TOut>
+void ConvertScaledSwap32(const unsigned char *in,
+                         const size_t         n,
+                         const double         slope,
+                         const double         offset,
+                         TOut *const          out) {
+    static_assert(sizeof(TIn) == 4, "Only for 32-bit inputs");
+    using TReal             = typename RealType<TOut>::type;
+    constexpr size_t block  = 1024;
+    uint16_t         halves[2 * block];
+    for (size_t start = 0; start < n; start += block) {
+        const size_t               count = std::min(block, n - start);
+        const unsigned char *const src   = in + start * sizeof(TIn);
+#pragma omp simd
+        for (size_t j = 0; j < 2 * count; j++) {
+            const uint16_t half = Load<uint16_t, false>(src + j * sizeof(uint16_t));
+            halves[j]           = static_cast<uint16_t>((half >> 8) | (half << 8));
+        }
+#pragma omp simd
+        for (size_t i = 0; i < count; i++) {
+            /* The first half in the file holds the most significant bytes */
+            const uint32_t bits = (static_cast<uint32_t>(halves[2 * i]) << 16) | halves[2 * i + 1];
+            TIn            value;
+            std::memcpy(&value, &bits, sizeof(TIn));
+            out[start + i] = static_cast<TReal>(static_cast<double>(value) * slope + offset);
+        }
+    }
+}
+
+/*
+ * Convert n values of type TIn stored (possibly byte-swapped) at in, to out = in * slope + offset
+ */
+template <typename TIn, typename TOut>
+void ConvertScaled(const void * in,
+                   const size_t n,
+                   const bool   swap,
+                   const double slope,
+                   const double offset,
+                   TOut *const  out) {
+    const auto bytes = static_cast<const unsigned char *>(in);
+    if (!swap) {
+        ConvertScaledImpl<TIn, TOut, false>(bytes, n, slope, offset, out);
+    } else if constexpr (sizeof(TIn) == 4) {
+        ConvertScaledSwap32<TIn, TOut>(bytes, n, slope, offset, out);
+    } else {
+        ConvertScaledImpl<TIn, TOut, true>(bytes, n, slope, offset, out);
+    }
+}
+
+} // namespace Kernels
+
+#endif // KERNELS_H
@@ -0,0 +1,216 @@
+/*
+ *  Nifti.cpp
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Contains template definitions and explicit instantiations (see note in IO.h)
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+
+#include "itkImage.h"
+
+#include "Macro.h"
+#include "Nifti.h"
+
+template <typename T> struct NiftiType;
+template <> struct NiftiType<std::complex<float>> {
+    static constexpr int16_t code = 32; // NIFTI_TYPE_COMPLEX64
+};
+template <> struct NiftiType<std::complex<double>> {
+    static constexpr int16_t code = 1792; // NIFTI_TYPE_COMPLEX128
+};
+
+/*
+ * The header is written field by field at the offsets in nifti1.h, in native byte order
+ */
+class NiftiHeader {
+  public:
+    NiftiHeader() { std::memset(m_bytes, 0, sizeof(m_bytes)); }
+
+    template <typename T> void Set(const size_t offset, const T value) {
+        std::memcpy(m_bytes + offset, &value, sizeof(T));
+    }
+
+    void SetString(const size_t offset, const char *value) {
+        std::strcpy(m_bytes + offset, value);
+    }
+
+    const char *Bytes() const { return m_bytes; }
+    size_t      Size() const { return sizeof(m_bytes); }
+
+  private:
+    char m_bytes[352]; // 348 byte header then 4 bytes of (empty) extension flags
+};
+
+/*
+ * Same algorithm as nifti_mat44_to_quatern, assuming the direction is orthonormal
+ */
+static void SetQuaternion(NiftiHeader &hdr, double r[3][3]) {
+    const double det = r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1]) -
+                       r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0]) +
+                       r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+    const float qfac = det < 0 ? -1.f : 1.f;
+    if (det < 0) {
+        for (int i = 0; i < 3; i++) {
+            r[i][2] = -r[i][2];
+        }
+    }
+    double a = r[0][0] + r[1][1] + r[2][2] + 1.0, b, c, d;
+    if (a > 0.5) {
+        a = 0.5 * std::sqrt(a);
+        b = 0.25 * (r[2][1] - r[1][2]) / a;
+        c = 0.25 * (r[0][2] - r[2][0]) / a;
+        d = 0.25 * (r[1][0] - r[0][1]) / a;
+    } else {
+        const double xd = 1.0 + r[0][0] - (r[1][1] + r[2][2]);
+        const double yd = 1.0 + r[1][1] - (r[0][0] + r[2][2]);
+        const double zd = 1.0 + r[2][2] - (r[0][0] + r[1][1]);
+        if (xd > 1.0) {
+            b = 0.5 * std::sqrt(xd);
+            c = 0.25 * (r[0][1] + r[1][0]) / b;
+            d = 0.25 * (r[0][2] + r[2][0]) / b;
+            a = 0.25 * (r[2][1] - r[1][2]) / b;
+        } else if (yd > 1.0) {
+            c = 0.5 * std::sqrt(yd);
+            b = 0.25 * (r[0][1] + r[1][0]) / c;
+            d = 0.25 * (r[1][2] + r[2][1]) / c;
+            a = 0.25 * (r[0][2] - r[2][0]) / c;
+        } else {
+            d = 0.5 * std::sqrt(zd);
+            b = 0.25 * (r[0][2] + r[2][0]) / d;
+            c = 0.25 * (r[1][2] + r[2][1]) / d;
+            a = 0.25 * (r[1][0] - r[0][1]) / d;
+        }
+        if (a < 0) {
+            b = -b;
+            c = -c;
+            d = -d;
+        }
+    }
+    hdr.Set<float>(76, qfac); // pixdim[0]
+    hdr.Set<float>(256, static_cast<float>(b));
+    hdr.Set<float>(260, static_cast<float>(c));
+    hdr.Set<float>(264, static_cast<float>(d));
+}
+
+bool IsNifti(const std::string &path) {
+    for (const std::string ext : {".nii", ".nii.gz"}) {
+        if (path.size() > ext.size() &&
+            path.compare(path.size() - ext.size(), ext.size(), ext) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename TImg>
+NiftiVolumeWriter<TImg>::NiftiVolumeWriter(const TImg *image, const std::string &path) :
+    m_path(path) {
+    using TPixel             = typename TImg::PixelType;
+    constexpr unsigned int D = TImg::ImageDimension;
+    static_assert(D >= 3 && D <= 7, "NIfTI volumes must be 3D, and NIfTI has at most 7 dimensions");
+
+    const auto size      = image->GetLargestPossibleRegion().GetSize();
+    const auto spacing   = image->GetSpacing();
+    const auto origin    = image->GetOrigin();
+    const auto direction = image->GetDirection();
+    m_volume_pixels      = size[0] * size[1] * size[2];
+    m_volumes            = 1;
+    for (unsigned int d = 3; d < D; d++) {
+        m_volumes *= size[d];
+    }
+
+    for (unsigned int d = 0; d < D; d++) {
+        if (size[d] > 32767) {
+            FAIL("Image is too large for NIfTI-1: " << path);
+        }
+    }
+
+    NiftiHeader hdr;
+    hdr.Set<int32_t>(0, 348);                            // sizeof_hdr
+    hdr.Set<char>(38, 'r');                              // regular
+    hdr.Set<int16_t>(40, D);                             // dim[0]
+    for (unsigned int d = 0; d < D; d++) {
+        hdr.Set<int16_t>(42 + 2 * d, size[d]);           // dim[1..]
+        hdr.Set<float>(80 + 4 * d, spacing[d]);          // pixdim[1..]
+    }
+    hdr.Set<int16_t>(70, NiftiType<TPixel>::code);       // datatype
+    hdr.Set<int16_t>(72, 8 * sizeof(TPixel));            // bitpix
+    hdr.Set<float>(108, hdr.Size());                     // vox_offset
+    hdr.Set<float>(112, 1.f);                            // scl_slope
+    hdr.Set<char>(123, 2 | 8);                           // xyzt_units, mm and s
+    hdr.Set<int16_t>(252, 1);                            // qform_code, scanner
+    hdr.Set<int16_t>(254, 1);                            // sform_code, scanner
+    hdr.SetString(344, "n+1");                           // magic
+
+    /* ITK geometry is LPS, NIfTI is RAS, so flip the first two rows */
+    double rotation[3][3];
+    for (int i = 0; i < 3; i++) {
+        const double flip = i < 2 ? -1.0 : 1.0;
+        for (int j = 0; j < 3; j++) {
+            rotation[i][j] = flip * direction(i, j);
+            hdr.Set<float>(280 + 16 * i + 4 * j, rotation[i][j] * spacing[j]); // srow_x/y/z
+        }
+        hdr.Set<float>(280 + 16 * i + 12, flip * origin[i]);
+        hdr.Set<float>(268 + 4 * i, flip * origin[i]); // qoffset_x/y/z
+    }
+    SetQuaternion(hdr, rotation);
+
+    const bool compress = path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0;
+    m_file              = gzopen(path.c_str(), compress ? "wb" : "wbT");
+    if (!m_file) {
+        FAIL("Could not open for writing: " << path);
+    }
+    if (gzwrite(m_file, hdr.Bytes(), hdr.Size()) != static_cast<int>(hdr.Size())) {
+        gzclose(m_file);
+        FAIL("Failed to write header: " << path);
+    }
+}
+
+template <typename TImg> NiftiVolumeWriter<TImg>::~NiftiVolumeWriter() {
+    if (m_file) {
+        gzclose(m_file);
+    }
+}
+
+template <typename TImg>
+void NiftiVolumeWriter<TImg>::WriteVolume(const typename TImg::PixelType *data) {
+    if (m_written == m_volumes) {
+        FAIL("All " << m_volumes << " volumes have already been written to: " << m_path);
+    }
+    /* gzwrite takes an unsigned int count, so write large volumes in pieces */
+    const char *bytes     = reinterpret_cast<const char *>(data);
+    size_t      remaining = m_volume_pixels * sizeof(typename TImg::PixelType);
+    while (remaining > 0) {
+        const unsigned int n = static_cast<unsigned int>(std::min<size_t>(remaining, 1 << 30));
+        if (gzwrite(m_file, bytes, n) != static_cast<int>(n)) {
+            FAIL("Failed to write volume " << m_written << " to: " << m_path);
+        }
+        bytes += n;
+        remaining -= n;
+    }
+    m_written++;
+}
+
+template <typename TImg> void NiftiVolumeWriter<TImg>::Close() {
+    if (m_written != m_volumes) {
+        FAIL("Only wrote " << m_written << " of " << m_volumes << " volumes to: " << m_path);
+    }
+    const int result = gzclose(m_file);
+    m_file           = nullptr;
+    if (result != Z_OK) {
+        FAIL("Failed to write: " << m_path);
+    }
+}
+
+template class NiftiVolumeWriter<itk::Image<std::complex<float>, 4u>>;
+template class NiftiVolumeWriter<itk::Image<std::complex<double>, 4u>>;
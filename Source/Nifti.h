@@ -0,0 +1,50 @@
+/*
+ *  Nifti.h
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Write a NIfTI-1 file one volume at a time. ITK's NIfTI writer cannot stream, so it needs the
+ *  whole image in memory. This writes the header from the image information (the buffer is not
+ *  used) and then appends each volume as it is produced. Files ending in .gz are compressed.
+ *
+ *  Templates are explicitly instantiated in Nifti.cpp, see the note in IO.h.
+ *
+ */
+
+#ifndef NIFTI_H
+#define NIFTI_H
+
+#include <string>
+
+#include "itk_zlib.h"
+
+bool IsNifti(const std::string &path); //!< Does the path have a .nii or .nii.gz extension?
+
+template <typename TImg> class NiftiVolumeWriter {
+  public:
+    NiftiVolumeWriter(const TImg *image, const std::string &path);
+    ~NiftiVolumeWriter();
+    NiftiVolumeWriter(const NiftiVolumeWriter &) = delete;
+    NiftiVolumeWriter &operator=(const NiftiVolumeWriter &) = delete;
+
+    /*
+     * Append the next volume, data must hold one 3D volume of pixels
+     */
+    void WriteVolume(const typename TImg::PixelType *data);
+
+    /*
+     * Check that every volume was written and flush the file
+     */
+    void Close();
+
+  private:
+    std::string m_path;
+    gzFile      m_file = nullptr;
+    size_t      m_volume_pixels, m_volumes, m_written = 0;
+};
+
+#endif // NIFTI_H
@@ -12,6 +12,9 @@
 #include "Util.h"
 #include "Macro.h"
 
+#include <iomanip>
+#include <sstream>
+
 std::string StripExt(const std::string &filename) {
     std::size_t dot = filename.find_last_of(".");
     if (dot != std::string::npos) {
@@ -73,6 +76,36 @@ std::string SanitiseString(const std::string &s) {
     return out;
 }
 
+std::string JSONString(const std::string &s) {
+    std::ostringstream out;
+    out << '"';
+    for (const char c : s) {
+        switch (c) {
+        case '"':
+            out << "\\\"";
+            break;
+        case '\\':
+            out << "\\\\";
+            break;
+        case '\n':
+            out << "\\n";
+            break;
+        case '\t':
+            out << "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                    << static_cast<int>(c) << std::dec;
+            } else {
+                out << c;
+            }
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
 template <>
 std::string GetMetaDataFromString(const itk::MetaDataDictionary &dict,
                                   const std::string &            name,
@@ -83,4 +116,30 @@ std::string GetMetaDataFromString(const itk::MetaDataDictionary &dict,
     } else {
         return string_value;
     }
-}
\ No newline at end of file
+}
+
+std::string GetMetaDataAsString(const itk::MetaDataDictionary &dict,
+                                const std::string &            name,
+                                const std::string &            def) {
+    std::vector<std::vector<std::string>> string_array_array_value;
+    std::vector<std::string>              string_array_value;
+    std::vector<double>                   double_array_value;
+    std::string                           string_value;
+    double                                double_value;
+    std::ostringstream                    formatted;
+    if (ExposeMetaData(dict, name, string_value)) {
+        return string_value;
+    } else if (ExposeMetaData(dict, name, string_array_value) && !string_array_value.empty()) {
+        return string_array_value[0];
+    } else if (ExposeMetaData(dict, name, string_array_array_value) &&
+               !string_array_array_value.empty() && !string_array_array_value[0].empty()) {
+        return string_array_array_value[0][0];
+    } else if (ExposeMetaData(dict, name, double_array_value)) {
+        formatted << double_array_value;
+        return formatted.str();
+    } else if (ExposeMetaData(dict, name, double_value)) {
+        formatted << double_value;
+        return formatted.str();
+    }
+    return def;
+}
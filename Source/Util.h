@@ -24,6 +24,7 @@ std::string
 std::string Basename(const std::string &path);    //!< Return only the filename part of a path
 std::string Trim(const std::string &s);           //!< Remove leading and trailing whitespace
 std::string SanitiseString(const std::string &s); //!< Remove undesirable characters from a filename
+std::string JSONString(const std::string &s);     //!< Quote and escape a string for JSON output
 
 /*
  * Print a std::vector
@@ -32,9 +33,9 @@ template <typename T> inline std::ostream &operator<<(std::ostream &os, const st
     os << "(";
     if (vec.size() > 0) {
         auto it = vec.begin();
-        std::cout << *it;
+        os << *it;
         for (it++; it != vec.end(); it++) {
-            std::cout << ", " << *it;
+            os << ", " << *it;
         }
     }
     os << ")";
@@ -75,4 +76,12 @@ std::string GetMetaDataFromString(const itk::MetaDataDictionary &dict,
                                   const std::string &            name,
                                   const std::string &            def);
 
+/*
+ * Recover a value as a string whichever type the reader stored it as (a string, the first entry
+ * of a string array, or formatted numbers). Returns def if the value is missing or unrecognised.
+ */
+std::string GetMetaDataAsString(const itk::MetaDataDictionary &dict,
+                                const std::string &            name,
+                                const std::string &            def);
+
 #endif // UTIL_H
@@ -9,14 +9,21 @@
  *
  */
 
+#include <complex>
 #include <iomanip>
+#include <memory>
 
 #include "itkImage.h"
+#include "itkImageFileWriter.h"
 #include "itkImageIOFactory.h"
+#include "itkImageSource.h"
 #include "itkMetaDataObject.h"
 
 #include "Args.h"
+#include "Bruker.h"
+#include "Chunked.h"
 #include "IO.h"
+#include "Nifti.h"
 #include "Util.h"
 
 /*
@@ -40,6 +47,20 @@ args::ValueFlagList<std::string> rename_args(
     parser, "RENAME", "Rename using specified header fields (can be multiple).", {'r', "rename"});
 args::ValueFlag<std::string>
     prefix(parser, "PREFIX", "Add a prefix to output filename.", {'p', "prefix"});
+args::Flag complex_output(parser,
+                          "COMPLEX",
+                          "Combine real/imaginary volumes into a complex image",
+                          {'x', "complex"});
+args::Flag direct(parser,
+                  "DIRECT",
+                  "Read the 2dseq file directly, a volume at a time, instead of through ITK",
+                  {"direct"});
+args::Flag plan(parser,
+                "PLAN",
+                "Only read the header and print a JSON plan of outputs and memory use",
+                {"plan"});
+args::ValueFlag<size_t>
+    chunk_slices(parser, "CHUNK", "Slices per chunk for .nch output (default 1)", {"chunk"}, 1);
 
 /*
  * Helper function to work out the name of the output file
@@ -48,11 +69,6 @@ std::string RenameFromHeader(const itk::MetaDataDictionary &header) {
     bool        append_delim = false;
     std::string output;
     for (const auto &rename_field : args::get(rename_args)) {
-        std::vector<std::vector<std::string>> string_array_array_value;
-        std::vector<std::string>              string_array_value;
-        std::vector<double>                   double_array_value;
-        std::string                           string_value;
-        double                                double_value;
         if (!header.HasKey(rename_field)) {
             if (verbose)
                 std::cerr << "Rename field '" << rename_field << "' not found in header. Ignoring"
@@ -64,73 +80,329 @@ std::string RenameFromHeader(const itk::MetaDataDictionary &header) {
         } else {
             append_delim = true;
         }
-        if (ExposeMetaData(header, rename_field, string_array_array_value)) {
-            output.append(SanitiseString(string_array_array_value[0][0]));
-        } else if (ExposeMetaData(header, rename_field, string_array_value)) {
-            output.append(SanitiseString(string_array_value[0]));
-        } else if (ExposeMetaData(header, rename_field, string_value)) {
-            output.append(SanitiseString(string_value));
-        } else if (ExposeMetaData(header, rename_field, double_array_value)) {
-            std::ostringstream formatted;
-            formatted << double_array_value;
-            output.append(SanitiseString(formatted.str()));
-        } else if (ExposeMetaData(header, rename_field, double_value)) {
-            std::ostringstream formatted;
-            formatted << double_value;
-            output.append(SanitiseString(formatted.str()));
-        } else {
-            if (verbose)
-                std::cerr << "Could not determine type of rename header field, ignoring:"
-                          << rename_field << std::endl;
+        const std::string value = GetMetaDataAsString(header, rename_field, "");
+        if (!value.empty()) {
+            output.append(SanitiseString(value));
+        } else if (verbose) {
+            std::cerr << "Could not determine type of rename header field, ignoring:"
+                      << rename_field << std::endl;
         }
     }
     // Write output name to stdout so outer script can pick it up for method file
-    std::cout << output << std::endl;
+    if (!plan)
+        std::cout << output << std::endl;
     return output;
 }
 
 /*
- * Templated conversion functions to avoid macros
+ * Set the image size and orientation from the header, as ITK's reader would
  */
-template <typename T, int D> void Convert(const std::string &input, const std::string &output) {
-    typedef itk::Image<T, D> TImage;
-    if (verbose)
-        std::cerr << "Reading image: " << input << std::endl;
-    auto image = ReadImage<TImage>(input);
+template <typename TImage> void CopyHeaderGeometry(itk::ImageIOBase *header, TImage *image) {
+    constexpr unsigned int         D = TImage::ImageDimension;
+    typename TImage::SizeType      size;
+    typename TImage::SpacingType   spacing;
+    typename TImage::PointType     origin;
+    typename TImage::DirectionType direction;
+    direction.SetIdentity();
+    size.Fill(1);
+    spacing.Fill(1.0);
+    origin.Fill(0.0);
+    const unsigned int dims = std::min(header->GetNumberOfDimensions(), D);
+    for (unsigned int i = 0; i < dims; i++) {
+        size[i]         = header->GetDimensions(i);
+        spacing[i]      = header->GetSpacing(i);
+        origin[i]       = header->GetOrigin(i);
+        const auto axis = header->GetDirection(i);
+        for (unsigned int j = 0; j < dims; j++) {
+            direction(j, i) = axis[j];
+        }
+    }
+    image->SetLargestPossibleRegion(typename TImage::RegionType(size));
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+}
+
+template <typename TImage> void ScaleGeometry(TImage *image) {
     if (scale) {
         auto spacing = image->GetSpacing();
         auto origin  = image->GetOrigin();
-        for (int i = 0; i < D; i++) {
+        for (unsigned int i = 0; i < TImage::ImageDimension; i++) {
             spacing[i] *= 10;
             origin[i] *= 10;
         }
         image->SetSpacing(spacing);
         image->SetOrigin(origin);
     }
+}
+
+/*
+ * Read the 2dseq file a volume at a time directly into the image buffer
+ */
+template <typename TImage> auto ReadDirect(itk::ImageIOBase *header) -> typename TImage::Pointer {
+    Bruker2dseq seq(header);
+    auto        image = TImage::New();
+    CopyHeaderGeometry(header, image.GetPointer());
+    image->SetRegions(image->GetLargestPossibleRegion());
+    image->Allocate();
+    auto *data = image->GetBufferPointer();
+    for (size_t v = 0; v < seq.Volumes(); v++) {
+        seq.ReadVolume(v, data + v * seq.VolumePixels());
+    }
+    return image;
+}
+
+/*
+ * Templated conversion functions to avoid macros
+ */
+template <typename T, int D> void Convert(itk::ImageIOBase *header, const std::string &output) {
+    typedef itk::Image<T, D> TImage;
+    if (verbose)
+        std::cerr << "Reading image: " << header->GetFileName() << std::endl;
+    auto image = direct ? ReadDirect<TImage>(header) : ReadImage<TImage>(header->GetFileName());
+    ScaleGeometry(image.GetPointer());
     if (verbose)
         std::cerr << "Writing image: " << output << std::endl;
-    WriteImage<TImage>(image, output);
+    if (IsChunked(output)) {
+        WriteChunked<TImage>(image, output, args::get(chunk_slices));
+    } else {
+        WriteImage<TImage>(image, output);
+    }
     if (verbose)
         std::cerr << "Finished." << std::endl;
 }
 
 template <typename T>
-void ConvertFile(const std::string &input, const std::string &output, const int D) {
+void ConvertFile(itk::ImageIOBase *header, const std::string &output, const int D) {
     switch (D) {
     case 2:
-        Convert<T, 2>(input, output);
+        Convert<T, 2>(header, output);
         break;
     case 3:
-        Convert<T, 3>(input, output);
+        Convert<T, 3>(header, output);
         break;
     case 4:
-        Convert<T, 4>(input, output);
+        Convert<T, 4>(header, output);
         break;
     default:
         FAIL("Unsupported dimension: " << D);
     }
 }
 
+/*
+ * Check that a header can be paired into complex volumes, and return how many there will be. The
+ * real volumes only come before all the imaginary ones if FG_COMPLEX is the slowest frame group.
+ */
+size_t ComplexVolumes(itk::ImageIOBase *header) {
+    const auto &      dict = header->GetMetaDataDictionary();
+    const std::string type = GetMetaDataAsString(dict, "VisuCoreFrameType", "");
+    if (type != "COMPLEX_IMAGE") {
+        FAIL("Complex output requires VisuCoreFrameType COMPLEX_IMAGE, found '" << type << "'");
+    }
+    const auto groups = GetFrameGroups(dict);
+    if (groups.empty() || groups.back().find("FG_COMPLEX") == std::string::npos) {
+        FAIL("Complex output requires FG_COMPLEX to be the last frame group in VisuFGOrderDesc");
+    }
+    if (header->GetNumberOfDimensions() != 4) {
+        FAIL("Complex output requires 4D input, found " << header->GetNumberOfDimensions()
+                                                        << " dimensions");
+    }
+    const size_t volumes = header->GetDimensions(3);
+    if (volumes % 2 != 0) {
+        FAIL("Complex output requires an even number of volumes, found " << volumes);
+    }
+    return volumes / 2;
+}
+
+/*
+ * Bruker complex reconstructions with FG_COMPLEX as the last frame group are stored as all the
+ * real volumes followed by all the imaginary volumes (see ComplexVolumes). This source reads
+ * matching pairs straight from the 2dseq file and interleaves them, so that a streaming writer
+ * only needs to hold the volumes it is currently writing.
+ */
+template <typename T>
+class BrukerComplexSource : public itk::ImageSource<itk::Image<std::complex<T>, 4>> {
+  public:
+    using TImage       = itk::Image<std::complex<T>, 4>;
+    using Self         = BrukerComplexSource;
+    using Superclass   = itk::ImageSource<TImage>;
+    using Pointer      = itk::SmartPointer<Self>;
+    using ConstPointer = itk::SmartPointer<const Self>;
+    itkNewMacro(Self);
+    itkTypeMacro(BrukerComplexSource, ImageSource);
+
+    void SetHeader(itk::ImageIOBase *header) {
+        m_volumes = ComplexVolumes(header);
+        m_header  = header;
+        m_2dseq   = std::make_unique<Bruker2dseq>(header);
+        this->Modified();
+    }
+
+  protected:
+    BrukerComplexSource()           = default;
+    ~BrukerComplexSource() override = default;
+
+    void GenerateOutputInformation() override {
+        auto output = this->GetOutput();
+        CopyHeaderGeometry(m_header.GetPointer(), output);
+        auto size = output->GetLargestPossibleRegion().GetSize();
+        size[3]   = m_volumes;
+        output->SetLargestPossibleRegion(typename TImage::RegionType(size));
+        ScaleGeometry(output);
+    }
+
+    /* We can only read whole volumes */
+    void EnlargeOutputRequestedRegion(itk::DataObject *data) override {
+        auto       output    = dynamic_cast<TImage *>(data);
+        auto       requested = output->GetRequestedRegion();
+        const auto largest   = output->GetLargestPossibleRegion();
+        for (int i = 0; i < 3; i++) {
+            requested.SetIndex(i, largest.GetIndex(i));
+            requested.SetSize(i, largest.GetSize(i));
+        }
+        output->SetRequestedRegion(requested);
+    }
+
+    void GenerateData() override {
+        this->AllocateOutputs();
+        auto             output      = this->GetOutput();
+        const auto       region      = output->GetBufferedRegion();
+        const size_t     vol_pixels  = m_2dseq->VolumePixels();
+        const size_t     imag_offset = m_volumes;
+        std::vector<T>   scratch(vol_pixels);
+        std::complex<T> *data = output->GetBufferPointer();
+        for (size_t v = 0; v < region.GetSize(3); v++) {
+            const size_t     vol = region.GetIndex(3) + v;
+            std::complex<T> *dst = data + v * vol_pixels;
+            if (verbose)
+                std::cerr << "Reading complex volume " << vol << std::endl;
+            m_2dseq->ReadVolume(vol, scratch.data());
+            for (size_t i = 0; i < vol_pixels; i++) {
+                dst[i].real(scratch[i]);
+            }
+            m_2dseq->ReadVolume(vol + imag_offset, scratch.data());
+            for (size_t i = 0; i < vol_pixels; i++) {
+                dst[i].imag(scratch[i]);
+            }
+        }
+    }
+
+  private:
+    itk::ImageIOBase::Pointer    m_header;
+    std::unique_ptr<Bruker2dseq> m_2dseq;
+    size_t                       m_volumes = 0;
+};
+
+template <typename T> void ConvertComplex(itk::ImageIOBase *header, const std::string &output) {
+    auto source = BrukerComplexSource<T>::New();
+    source->SetHeader(header);
+    source->UpdateOutputInformation();
+    const auto volumes = source->GetOutput()->GetLargestPossibleRegion().GetSize()[3];
+
+    if (IsChunked(output)) {
+        /* Chunks are compressed from the image buffer, so this needs the whole image */
+        source->Update();
+        if (verbose)
+            std::cerr << "Writing chunked complex image: " << output << std::endl;
+        WriteChunked(source->GetOutput(), output, args::get(chunk_slices));
+        return;
+    }
+
+    if (IsNifti(output)) {
+        /* ITK's NIfTI writer cannot stream, so request and write one volume at a time */
+        auto image = source->GetOutput();
+        NiftiVolumeWriter<typename BrukerComplexSource<T>::TImage> writer(image, output);
+        auto region = image->GetLargestPossibleRegion();
+        region.SetSize(3, 1);
+        if (verbose)
+            std::cerr << "Writing complex image: " << output << std::endl;
+        for (size_t v = 0; v < volumes; v++) {
+            region.SetIndex(3, v);
+            image->SetRequestedRegion(region);
+            source->Update();
+            writer.WriteVolume(image->GetBufferPointer());
+        }
+        writer.Close();
+        if (verbose)
+            std::cerr << "Finished." << std::endl;
+        return;
+    }
+
+    /* One volume per stream division. Formats that cannot stream will request everything */
+    auto writer = itk::ImageFileWriter<typename BrukerComplexSource<T>::TImage>::New();
+    writer->SetFileName(output);
+    writer->SetInput(source->GetOutput());
+    writer->SetNumberOfStreamDivisions(volumes);
+    if (verbose)
+        std::cerr << "Writing complex image: " << output << std::endl;
+    writer->Update();
+    if (verbose)
+        std::cerr << "Finished." << std::endl;
+}
+
+/*
+ * Print what a conversion would do, using only the header, so that schedulers can size jobs
+ */
+void PrintPlan(itk::ImageIOBase *header, const std::string &output) {
+    const auto   dims         = header->GetNumberOfDimensions();
+    const size_t element_size = double_precision ? sizeof(double) : sizeof(float);
+    size_t       vol_pixels = 1, volumes = 1;
+    for (unsigned int i = 0; i < dims; i++) {
+        if (i < 3) {
+            vol_pixels *= header->GetDimensions(i);
+        } else {
+            volumes *= header->GetDimensions(i);
+        }
+    }
+    // Complex output halves the volumes but doubles the pixel size, fail now if it would later
+    const size_t output_volumes = complex_output ? ComplexVolumes(header) : volumes;
+    const size_t image_bytes    = vol_pixels * volumes * element_size;
+
+    // The direct reader also holds one raw volume from the 2dseq file
+    const size_t raw_volume_bytes = vol_pixels * header->GetComponentSize();
+    size_t       peak             = 0;
+    if (complex_output) {
+        itk::ImageIOBase::Pointer writer_io =
+            itk::ImageIOFactory::CreateImageIO(output.c_str(), itk::ImageIOFactory::WriteMode);
+        if (IsNifti(output) || (writer_io && writer_io->CanStreamWrite())) {
+            // One complex volume being written and one real scratch volume
+            peak = 3 * vol_pixels * element_size + raw_volume_bytes;
+        } else {
+            peak = image_bytes + vol_pixels * element_size + raw_volume_bytes;
+        }
+    } else if (direct) {
+        peak = image_bytes + raw_volume_bytes;
+    } else {
+        // ITK's reader needs a separate buffer unless the file type matches the output
+        const std::string file_type =
+            itk::ImageIOBase::GetComponentTypeAsString(header->GetComponentType());
+        const bool same_type = file_type == (double_precision ? "double" : "float");
+        peak                 = image_bytes + (same_type ? 0 : header->GetImageSizeInBytes());
+    }
+
+    const auto &dict = header->GetMetaDataDictionary();
+    const std::string uid  = GetMetaDataAsString(dict, "VisuUid", "");
+    const std::string type = GetMetaDataAsString(dict, "VisuCoreFrameType", "");
+    std::cout << "{\n  \"input\": " << JSONString(header->GetFileName()) << ",\n";
+    std::cout << "  \"uid\": " << JSONString(uid) << ",\n";
+    std::cout << "  \"type\": " << JSONString(type) << ",\n";
+    std::cout << "  \"dimensions\": [";
+    for (unsigned int i = 0; i < dims; i++) {
+        const size_t size = (complex_output && i == 3) ? output_volumes : header->GetDimensions(i);
+        std::cout << (i > 0 ? ", " : "") << size;
+    }
+    std::cout << "],\n  \"volumes\": " << output_volumes << ",\n";
+    std::cout << "  \"complex\": " << (complex_output ? "true" : "false") << ",\n";
+    // NIfTI header is 352 bytes. Compressed outputs (.nii.gz, .nch) will be smaller
+    std::cout << "  \"outputs\": [\n    {\"filename\": " << JSONString(output)
+              << ", \"bytes_upper_bound\": " << image_bytes + 352 << "}";
+    if (dict.HasKey("PVM_DwEffBval")) {
+        std::cout << ",\n    {\"filename\": " << JSONString(StripExt(output) + ".bval") << "}";
+        std::cout << ",\n    {\"filename\": " << JSONString(StripExt(output) + ".bvec") << "}";
+    }
+    std::cout << "\n  ],\n  \"peak_memory_bytes_upper_bound\": " << peak << "\n}" << std::endl;
+}
+
 int main(int argc, char **argv) {
     ParseArgs(parser, argc, argv);
 
@@ -154,14 +426,25 @@ int main(int argc, char **argv) {
         output_path += CheckPos(output_arg);
     }
 
+    if (plan) {
+        PrintPlan(header, output_path);
+        return EXIT_SUCCESS;
+    }
+
     auto dims = header->GetNumberOfDimensions();
     /* We don't need the pixel type because Bruker 'complex' images are real volumes then imaginary
      * volumes */
 
-    if (double_precision) {
-        ConvertFile<double>(input, output_path, dims);
+    if (complex_output) {
+        if (double_precision) {
+            ConvertComplex<double>(header, output_path);
+        } else {
+            ConvertComplex<float>(header, output_path);
+        }
+    } else if (double_precision) {
+        ConvertFile<double>(header, output_path, dims);
     } else {
-        ConvertFile<float>(input, output_path, dims);
+        ConvertFile<float>(header, output_path, dims);
     }
 
     if (dict.HasKey("PVM_DwEffBval")) {
@@ -10,10 +10,17 @@
  */
 
 #include <algorithm>
+#include <cstdio>
 #include <set>
+#include <sstream>
+#include <stdexcept>
 
 #include "fmt/format.h"
 #include "fmt/ostream.h"
+#include "gdcmImageHelper.h"
+#include "gdcmImageReader.h"
+#include "gdcmReader.h"
+#include "gdcmStringFilter.h"
 #include "itkComposeImageFilter.h"
 #include "itkGDCMImageIO.h"
 #include "itkGDCMSeriesFileNames.h"
@@ -24,7 +31,9 @@
 #include "itkJoinSeriesImageFilter.h"
 
 #include "Args.h"
+#include "Chunked.h"
 #include "IO.h"
+#include "Kernels.h"
 #include "Util.h"
 
 /*
@@ -46,15 +55,58 @@ args::ValueFlagList<std::string> rename_args(
 args::ValueFlag<std::string>
     out_name(parser, "OUTNAME", "Use specified output name (overrides RENAME)", {'o', "out"});
 args::ValueFlag<std::string> ext_flag(
-    parser, "EXTENSION", "File extension/format to use (default .nii)", {'e', "ext"}, ".nii");
+    parser,
+    "EXTENSION",
+    "File extension/format to use (default .nii, .nch for chunked)",
+    {'e', "ext"},
+    ".nii");
 args::ValueFlag<std::string>
     prefix(parser, "PREFIX", "Add a prefix to output filename", {'p', "prefix"});
+args::Flag plan(parser,
+                "PLAN",
+                "Only read headers and print a JSON plan of outputs and memory use",
+                {"plan"});
+args::Flag direct(parser,
+                  "DIRECT",
+                  "Read and rescale slices with GDCM directly instead of through ITK",
+                  {"direct"});
+args::ValueFlag<size_t>
+    chunk_slices(parser, "CHUNK", "Slices per chunk for .nch output (default 1)", {"chunk"}, 1);
+
+/*
+ * In plan mode stdout carries the JSON, so progress and errors go to stderr
+ */
+std::FILE *log_file() {
+    return plan ? stderr : stdout;
+}
 
 using Slice   = itk::Image<float, 2>;
 using Volume  = itk::Image<float, 3>;
 using Series  = itk::Image<float, 4>;
 using XSeries = itk::Image<std::complex<float>, 4>;
 
+struct Vec3 {
+    float x, y, z;
+};
+
+/*
+ * Everything about a series that can be found from the headers alone
+ */
+struct series_info {
+    std::string       uid;
+    int               type;
+    size_t            slice_pixels, slices, volumes;
+    Volume::PointType origin;
+
+    size_t bytes() const { return slice_pixels * slices * volumes * sizeof(float); }
+};
+
+struct output_info {
+    std::string filename;
+    size_t      first; // Index into the series list, complex outputs also use first + 1
+    bool        complex;
+};
+
 template <typename T>
 void write_image(typename T::Pointer image,
                  std::string const & filename,
@@ -65,15 +117,240 @@ void write_image(typename T::Pointer image,
     spacing[3]   = TR;
     image->SetSpacing(spacing);
 
+    if (IsChunked(filename)) {
+        if (verbose) {
+            fmt::print(log_file(), "Writing chunked: {}\n", filename);
+        }
+        WriteChunked<T>(image, filename, args::get(chunk_slices));
+        return;
+    }
+
     auto writer = itk::ImageFileWriter<T>::New();
     writer->SetFileName(filename);
     writer->SetInput(image);
     if (verbose) {
-        fmt::print("Writing: {}\n", filename);
+        fmt::print(log_file(), "Writing: {}\n", filename);
     }
     writer->Update();
 }
 
+/*
+ * The tags used by the header scan. In plan mode only these are read, as strings, so that
+ * GetMetaDataFromString sees the same values as it would from GDCMImageIO
+ */
+std::vector<std::string> const scan_tags{"0008|0008",
+                                         "0008|103e",
+                                         "0018|0080",
+                                         "0018|0081",
+                                         "0018|1250",
+                                         "0019|10bb",
+                                         "0019|10bc",
+                                         "0019|10bd",
+                                         "0020|0011",
+                                         "0020|0013",
+                                         "0020|0032",
+                                         "0020|0100",
+                                         "0020|1041",
+                                         "0028|0010",
+                                         "0028|0011",
+                                         "0043|1039",
+                                         "0043|102f"};
+
+/*
+ * GDCMImageIO::ReadImageInformation loads the pixel data as well, so for plans read the header
+ * with GDCM directly and stop at the Pixel Data element
+ */
+itk::MetaDataDictionary read_header(std::string const &path) {
+    gdcm::Reader reader;
+    reader.SetFileName(path.c_str());
+    if (!reader.ReadUpToTag(gdcm::Tag(0x7fe0, 0x0010))) {
+        throw std::runtime_error("Could not read DICOM header: " + path);
+    }
+    gdcm::StringFilter filter;
+    filter.SetFile(reader.GetFile());
+    gdcm::DataSet const &   dataset = reader.GetFile().GetDataSet();
+    itk::MetaDataDictionary meta;
+    for (auto const &key : scan_tags) {
+        gdcm::Tag tag;
+        tag.ReadFromPipeSeparatedString(key.c_str());
+        if (dataset.FindDataElement(tag)) {
+            itk::EncapsulateMetaData<std::string>(meta, key, filter.ToString(tag));
+        }
+    }
+    return meta;
+}
+
+/*
+ * Image Position (Patient), which is what GDCMImageIO reports as the origin of a single slice
+ */
+Volume::PointType header_origin(itk::MetaDataDictionary const &meta) {
+    Volume::PointType  origin;
+    std::istringstream position(GetMetaDataFromString<std::string>(meta, "0020|0032", ""));
+    std::string        value;
+    for (int d = 0; d < 3; d++) {
+        origin[d] = std::getline(position, value, '\\') ? std::stod(value) : 0.0;
+    }
+    return origin;
+}
+
+/*
+ * Read the stored values of each slice with GDCM and rescale them straight into the volume
+ * buffer, instead of going through ITK's generic per-pixel conversion. Returns nullptr if the
+ * slices are not a pixel format the kernels handle, so the caller can fall back to ITK. Only
+ * used with --direct, ITK's series reader remains the reference.
+ */
+Volume::Pointer read_volume(std::vector<std::string> const &paths, itk::GDCMImageIO *dicomIO) {
+    // gdcm::ImageReader only fills in the slope and intercept for MR images if this is set.
+    // GDCMImageIO sets it as a side-effect, but do not rely on that
+    gdcm::ImageHelper::SetForceRescaleInterceptSlope(true);
+    dicomIO->SetFileName(paths.front());
+    dicomIO->ReadImageInformation();
+    if (dicomIO->GetNumberOfDimensions() != 3 || dicomIO->GetDimensions(2) != 1) {
+        return nullptr; // Multi-frame
+    }
+    Volume::SizeType      size;
+    Volume::SpacingType   spacing;
+    Volume::PointType     origin;
+    Volume::DirectionType direction;
+    for (int i = 0; i < 3; i++) {
+        size[i]         = i < 2 ? dicomIO->GetDimensions(i) : paths.size();
+        spacing[i]      = dicomIO->GetSpacing(i);
+        origin[i]       = dicomIO->GetOrigin(i);
+        auto const axis = dicomIO->GetDirection(i);
+        for (int j = 0; j < 3; j++) {
+            direction(j, i) = axis[j];
+        }
+    }
+    if (paths.size() > 1) {
+        // Match ImageSeriesReader with ForceOrthogonalDirectionOff, slices may be tilted
+        dicomIO->SetFileName(paths.back());
+        dicomIO->ReadImageInformation();
+        Volume::PointType last;
+        for (int i = 0; i < 3; i++) {
+            last[i] = dicomIO->GetOrigin(i);
+        }
+        auto const slice_dir = last - origin;
+        auto const distance  = slice_dir.GetNorm();
+        if (distance > 0) {
+            for (int j = 0; j < 3; j++) {
+                direction(j, 2) = slice_dir[j] / distance;
+            }
+            spacing[2] = distance / (paths.size() - 1);
+        }
+    }
+
+    auto volume = Volume::New();
+    volume->SetRegions(Volume::RegionType(size));
+    volume->SetSpacing(spacing);
+    volume->SetOrigin(origin);
+    volume->SetDirection(direction);
+    volume->Allocate();
+
+    size_t const      slice_pixels = size[0] * size[1];
+    std::vector<char> raw;
+    for (size_t s = 0; s < paths.size(); s++) {
+        gdcm::ImageReader reader;
+        reader.SetFileName(paths[s].c_str());
+        if (!reader.Read()) {
+            return nullptr;
+        }
+        gdcm::Image const &      image  = reader.GetImage();
+        gdcm::PixelFormat const &format = image.GetPixelFormat();
+        if (format.GetSamplesPerPixel() != 1 || image.GetDimension(0) != size[0] ||
+            image.GetDimension(1) != size[1]) {
+            return nullptr;
+        }
+        raw.resize(image.GetBufferLength());
+        if (raw.size() < slice_pixels * format.GetPixelSize() || !image.GetBuffer(raw.data())) {
+            return nullptr;
+        }
+        char const *const in        = raw.data();
+        double const      slope     = image.GetSlope();
+        double const      intercept = image.GetIntercept();
+        float *const      dst       = volume->GetBufferPointer() + s * slice_pixels;
+        switch (format.GetScalarType()) {
+        case gdcm::PixelFormat::INT16:
+            Kernels::ConvertScaled<int16_t>(in, slice_pixels, false, slope, intercept, dst);
+            break;
+        case gdcm::PixelFormat::UINT16:
+            Kernels::ConvertScaled<uint16_t>(in, slice_pixels, false, slope, intercept, dst);
+            break;
+        case gdcm::PixelFormat::INT32:
+            Kernels::ConvertScaled<int32_t>(in, slice_pixels, false, slope, intercept, dst);
+            break;
+        default:
+            return nullptr;
+        }
+    }
+    return volume;
+}
+
+/*
+ * Estimate the peak memory use of a conversion. Each series is read into volumes which are then
+ * joined, so both copies exist briefly, and every series is held until the end. Complex outputs
+ * need an extra buffer twice the size of the real series while they are written.
+ */
+size_t peak_memory(std::vector<series_info> const &info, std::vector<output_info> const &outputs) {
+    size_t held = 0, peak = 0;
+    for (auto const &series : info) {
+        peak = std::max(peak, held + 2 * series.bytes());
+        held += series.bytes();
+    }
+    size_t complex_buffer = 0;
+    for (auto const &output : outputs) {
+        if (output.complex) {
+            complex_buffer = std::max(complex_buffer, 2 * info.at(output.first).bytes());
+        }
+    }
+    return std::max(peak, held + complex_buffer);
+}
+
+/*
+ * Print the header scan as JSON so that schedulers can size jobs before converting
+ */
+void print_plan(std::string const &             input_dir,
+                std::vector<series_info> const &info,
+                std::vector<output_info> const &outputs,
+                std::string const &             param_filename) {
+    fmt::print("{{\n  \"input\": {},\n  \"series\": [", JSONString(input_dir));
+    for (size_t i = 0; i < info.size(); i++) {
+        auto const &series = info[i];
+        fmt::print("{}\n    {{\"uid\": {}, \"type\": {}, \"slices\": {}, \"volumes\": {}, "
+                   "\"slice_pixels\": {}, \"bytes\": {}}}",
+                   i > 0 ? "," : "",
+                   JSONString(series.uid),
+                   series.type,
+                   series.slices,
+                   series.volumes,
+                   series.slice_pixels,
+                   series.bytes());
+    }
+    fmt::print("\n  ],\n  \"outputs\": [");
+    for (size_t i = 0; i < outputs.size(); i++) {
+        auto const &output = outputs[i];
+        auto const &series = info.at(output.first);
+        std::string uids   = JSONString(series.uid);
+        if (output.complex) {
+            uids += ", " + JSONString(info.at(output.first + 1).uid);
+        }
+        // NIfTI header is 352 bytes, complex outputs have twice the bytes per pixel. Compressed
+        // outputs (.nii.gz, .nch) will be smaller
+        size_t const bytes = 352 + (output.complex ? 2 : 1) * series.bytes();
+        fmt::print("{}\n    {{\"filename\": {}, \"series\": [{}], \"complex\": {}, "
+                   "\"bytes_upper_bound\": {}}}",
+                   i > 0 ? "," : "",
+                   JSONString(output.filename),
+                   uids,
+                   output.complex ? "true" : "false",
+                   bytes);
+    }
+    fmt::print("\n  ],\n");
+    if (!param_filename.empty()) {
+        fmt::print("  \"params\": {},\n", JSONString(param_filename));
+    }
+    fmt::print("  \"peak_memory_bytes_upper_bound\": {}\n}}\n", peak_memory(info, outputs));
+}
+
 int main(int argc, char **argv) {
     ParseArgs(parser, argc, argv);
     const std::string input_dir      = CheckPos(input_arg);
@@ -89,46 +366,59 @@ int main(int argc, char **argv) {
     try {
         auto seriesUIDs = name_generator->GetSeriesUIDs();
         if (seriesUIDs.size() == 0) {
+            if (plan) {
+                print_plan(input_dir, {}, {}, "");
+                return EXIT_SUCCESS;
+            }
             fmt::print("No DICOMs in: {}", input_dir);
             return EXIT_SUCCESS;
         } else {
             if (verbose) {
-                fmt::print(
-                    "Directory: {}\nContains {} DICOM Series\n", input_dir, seriesUIDs.size());
+                fmt::print(log_file(),
+                           "Directory: {}\nContains {} DICOM Series\n",
+                           input_dir,
+                           seriesUIDs.size());
             }
         }
 
-        struct Vec3 {
-            float x, y, z;
-        };
         std::vector<Series::Pointer> all_series;
-        std::vector<int>             all_types;
+        std::vector<series_info>     all_info;
         itk::MetaDataDictionary      meta;            // Need this after the loop for writing
         std::set<float>              slocs, tes, b0s; // Need these after loop
         std::vector<Vec3>            b_dirs;
         for (auto const &seriesID : seriesUIDs) {
             std::vector<std::string> allNames = name_generator->GetFileNames(seriesID);
             if (verbose) {
-                fmt::print("Reading {}\nContains {} slices\n", seriesID, allNames.size());
+                fmt::print(
+                    log_file(), "Reading {}\nContains {} slices\n", seriesID, allNames.size());
             }
             if (allNames.size() == 0) {
                 continue;
             }
             struct dicom_entry {
-                std::string path;
-                float       sloc, te; // Position
-                int         b0, temporal, instance;
-                Vec3        b_dir;
-                std::string casl, coil;
+                std::string       path;
+                float             sloc, te; // Position
+                int               b0, temporal, instance;
+                Vec3              b_dir;
+                std::string       casl, coil;
+                Volume::PointType origin;
             };
             std::vector<dicom_entry> dicoms(allNames.size());
 
             auto dicomIO = itk::GDCMImageIO::New();
             dicomIO->LoadPrivateTagsOn();
             for (size_t i = 0; i < allNames.size(); i++) {
-                dicomIO->SetFileName(allNames[i]);
-                dicomIO->ReadImageInformation();
-                meta               = dicomIO->GetMetaDataDictionary();
+                if (plan) {
+                    meta             = read_header(allNames[i]);
+                    dicoms[i].origin = header_origin(meta);
+                } else {
+                    dicomIO->SetFileName(allNames[i]);
+                    dicomIO->ReadImageInformation();
+                    meta = dicomIO->GetMetaDataDictionary();
+                    for (int d = 0; d < 3; d++) {
+                        dicoms[i].origin[d] = dicomIO->GetOrigin(d);
+                    }
+                }
                 dicoms[i].path     = allNames[i];
                 dicoms[i].sloc     = GetMetaDataFromString<float>(meta, "0020|1041", 0);
                 dicoms[i].te       = GetMetaDataFromString<float>(meta, "0018|0081", 0);
@@ -141,9 +431,13 @@ int main(int argc, char **argv) {
                 dicoms[i].casl     = GetMetaDataFromString<std::string>(meta, "0008|0008", "0");
                 dicoms[i].coil     = GetMetaDataFromString<std::string>(meta, "0018|1250", "0");
             }
+            size_t const slice_pixels =
+                plan ? GetMetaDataFromString<size_t>(meta, "0028|0010", 0) *
+                           GetMetaDataFromString<size_t>(meta, "0028|0011", 0) :
+                       dicomIO->GetDimensions(0) * dicomIO->GetDimensions(1);
 
             if (verbose)
-                fmt::print("Sorting images...\n");
+                fmt::print(log_file(), "Sorting images...\n");
             std::sort(dicoms.begin(), dicoms.end(), [&](dicom_entry &a, dicom_entry &b) {
                 return (a.sloc < b.sloc) ||
                        ((a.sloc == b.sloc) &&
@@ -157,7 +451,7 @@ int main(int argc, char **argv) {
             });
 
             if (verbose)
-                fmt::print("Extracting unique information...\n");
+                fmt::print(log_file(), "Extracting unique information...\n");
 
             // Some weird GE series can have differing numbers of slices
             slocs.clear();
@@ -171,7 +465,10 @@ int main(int argc, char **argv) {
 
             auto const vols = allNames.size() / slocs.size();
             if (verbose)
-                fmt::print("I think there are {} slices and {} volumes...\n", slocs.size(), vols);
+                fmt::print(log_file(),
+                           "I think there are {} slices and {} volumes...\n",
+                           slocs.size(),
+                           vols);
 
             if (b_dirs.size() == 0) {
                 for (size_t v = 0; v < vols; v++) {
@@ -179,6 +476,16 @@ int main(int argc, char **argv) {
                 }
             }
 
+            all_info.push_back({seriesID,
+                                GetMetaDataFromString<int>(meta, "0043|102f", 0),
+                                slice_pixels,
+                                slocs.size(),
+                                vols,
+                                dicoms[0].origin});
+            if (plan) {
+                continue;
+            }
+
             auto joiner = itk::JoinSeriesImageFilter<Volume, Series>::New();
             for (size_t v = 0; v < vols; v++) {
                 size_t                   dicomIndex = v;
@@ -187,16 +494,25 @@ int main(int argc, char **argv) {
                     volNames[s] = dicoms[dicomIndex].path;
                     dicomIndex += vols;
                 }
-                auto reader = itk::ImageSeriesReader<Volume>::New();
-                reader->SetImageIO(dicomIO);
-                reader->SetFileNames(volNames);
-                reader->ForceOrthogonalDirectionOff();
-                reader->Update();
-                joiner->SetInput(v, reader->GetOutput());
+                Volume::Pointer volume;
+                if (direct) {
+                    volume = read_volume(volNames, dicomIO);
+                }
+                if (!volume) {
+                    if (direct && verbose)
+                        fmt::print(log_file(),
+                                   "Unsupported pixel format, using ITK series reader\n");
+                    auto reader = itk::ImageSeriesReader<Volume>::New();
+                    reader->SetImageIO(dicomIO);
+                    reader->SetFileNames(volNames);
+                    reader->ForceOrthogonalDirectionOff();
+                    reader->Update();
+                    volume = reader->GetOutput();
+                }
+                joiner->SetInput(v, volume);
             }
             joiner->Update();
             all_series.push_back(joiner->GetOutput());
-            all_types.push_back(GetMetaDataFromString<int>(meta, "0043|102f", 0));
         }
 
         auto const series_number = GetMetaDataFromString<int>(meta, "0020|0011", 0);
@@ -211,34 +527,25 @@ int main(int argc, char **argv) {
 
         auto const filename =
             out_name ? out_name.Get() : fmt::format("{:04d}_{}", series_number, series_description);
-        std::set<int> processed_indices;
-        for (size_t i = 0; i < all_series.size(); i++) {
-            std::string const tag = all_series.size() > 1 ? fmt::format("{}", i + 1) : "";
-            if (!split_all && all_types[i] == 2) { // Real series
-                if ((i + 1 < all_series.size()) && (all_types[i + 1] == 3) &&
-                    (all_series.at(i)->GetOrigin().GetVnlVector().is_equal(
-                        all_series.at(i + 1)->GetOrigin().GetVnlVector(), 2.e-6))) {
-
+        std::vector<output_info> outputs;
+        std::set<size_t>         processed_indices;
+        for (size_t i = 0; i < all_info.size(); i++) {
+            std::string const tag = all_info.size() > 1 ? fmt::format("{}", i + 1) : "";
+            if (!split_all && all_info[i].type == 2) { // Real series
+                if ((i + 1 < all_info.size()) && (all_info[i + 1].type == 3) &&
+                    (all_info[i].origin.GetVnlVector().is_equal(
+                        all_info[i + 1].origin.GetVnlVector(), 2.e-6))) {
                     // We have matching real/imaginary series, convert to complex
-                    auto to_complex = itk::ComposeImageFilter<Series, XSeries>::New();
-                    to_complex->SetInput(0, all_series.at(i));
-                    to_complex->SetInput(1, all_series.at(i + 1));
-                    to_complex->Update();
-                    XSeries::Pointer x = to_complex->GetOutput();
-                    x->DisconnectPipeline();
-                    write_image<XSeries>(x, filename + extension, slice_thickness, TR);
+                    outputs.push_back({filename + extension, i, true});
                 } else {
-                    Series::Pointer m = all_series.at(i);
-                    write_image<Series>(m, filename + tag + extension, slice_thickness, TR);
+                    outputs.push_back({filename + tag + extension, i, false});
                 }
                 processed_indices.insert(i);
                 processed_indices.insert(i + 1);
             } else {
                 // Could be anything, write it if we haven't done so already
                 if (processed_indices.find(i) == processed_indices.end()) {
-
-                    Series::Pointer m = all_series.at(i);
-                    write_image<Series>(m, filename + tag + extension, slice_thickness, TR);
+                    outputs.push_back({filename + tag + extension, i, false});
                     processed_indices.insert(i);
                 }
             }
@@ -246,6 +553,26 @@ int main(int argc, char **argv) {
 
         auto const infoname = fmt::format("{:04d}_{}{}", series_number, series_description, ".txt");
 
+        if (plan) {
+            print_plan(input_dir, all_info, outputs, param_file ? infoname : "");
+            return EXIT_SUCCESS;
+        }
+
+        for (auto const &output : outputs) {
+            if (output.complex) {
+                auto to_complex = itk::ComposeImageFilter<Series, XSeries>::New();
+                to_complex->SetInput(0, all_series.at(output.first));
+                to_complex->SetInput(1, all_series.at(output.first + 1));
+                to_complex->Update();
+                XSeries::Pointer x = to_complex->GetOutput();
+                x->DisconnectPipeline();
+                write_image<XSeries>(x, output.filename, slice_thickness, TR);
+            } else {
+                Series::Pointer m = all_series.at(output.first);
+                write_image<Series>(m, output.filename, slice_thickness, TR);
+            }
+        }
+
         if (param_file) {
             std::ofstream info(infoname);
             info << "TR: " << TR << "\n";
@@ -268,7 +595,7 @@ int main(int argc, char **argv) {
             }
         }
     } catch (itk::ExceptionObject &ex) {
-        fmt::print("{}", ex.what());
+        fmt::print(log_file(), "{}", ex.what());
         return EXIT_FAILURE;
     }
     return EXIT_SUCCESS;
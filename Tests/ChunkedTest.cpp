@@ -0,0 +1,158 @@
+/*
+ *  ChunkedTest.cpp
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Write chunked images and check that the whole image and sub-regions read back unchanged.
+ *  Usage: test_chunked [DIR], the files are written to DIR (default the current directory).
+ *
+ */
+
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "itkImage.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include "Chunked.h"
+
+static int failures = 0;
+
+#define CHECK(x, msg)                                                                              \
+    if (!(x)) {                                                                                    \
+        std::cerr << "FAILED: " << msg << std::endl;                                               \
+        failures++;                                                                                \
+    }
+
+/*
+ * A different value for every pixel, so that misplaced chunks are caught
+ */
+template <typename T, unsigned int D> T Value(const itk::Index<D> &index) {
+    double v = 0, scale = 1;
+    for (unsigned int d = 0; d < D; d++) {
+        v += index[d] * scale;
+        scale *= 100;
+    }
+    return static_cast<T>(v);
+}
+template <> std::complex<float> Value<std::complex<float>, 4>(const itk::Index<4> &index) {
+    return {Value<float, 4>(index), -Value<float, 4>(index)};
+}
+
+template <typename TImg> typename TImg::Pointer MakeImage(const typename TImg::SizeType &size) {
+    constexpr unsigned int D     = TImg::ImageDimension;
+    auto                   image = TImg::New();
+    image->SetRegions(typename TImg::RegionType(size));
+    image->Allocate();
+    typename TImg::SpacingType   spacing;
+    typename TImg::PointType     origin;
+    typename TImg::DirectionType direction;
+    direction.Fill(0.0);
+    for (unsigned int d = 0; d < D; d++) {
+        spacing[d] = 0.5 + d;
+        origin[d]  = -10.0 * (d + 1);
+        /* Swap the first two axes so the direction is not the identity */
+        direction(d < 2 ? 1 - d : d, d) = 1.0;
+    }
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+    itk::ImageRegionIteratorWithIndex<TImg> it(image, image->GetLargestPossibleRegion());
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+        it.Set(Value<typename TImg::PixelType, D>(it.GetIndex()));
+    }
+    return image;
+}
+
+/*
+ * Check that every pixel of region in read matches the original values
+ */
+template <typename TImg>
+void CheckPixels(const TImg *                     read,
+                 const typename TImg::RegionType &region,
+                 const std::string &              what) {
+    constexpr unsigned int D = TImg::ImageDimension;
+    CHECK(read->GetBufferedRegion() == region, what << ": buffered region does not match");
+    if (read->GetBufferedRegion() != region) {
+        return;
+    }
+    size_t                                       wrong = 0;
+    itk::ImageRegionConstIteratorWithIndex<TImg> it(read, region);
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+        if (it.Get() != Value<typename TImg::PixelType, D>(it.GetIndex())) {
+            wrong++;
+        }
+    }
+    CHECK(wrong == 0, what << ": " << wrong << " pixels differ");
+}
+
+template <typename TImg>
+void RoundTrip(const typename TImg::SizeType &size,
+               const size_t                   chunk_slices,
+               const typename TImg::RegionType &sub_region,
+               const std::string &              path) {
+    constexpr unsigned int D     = TImg::ImageDimension;
+    auto                   image = MakeImage<TImg>(size);
+    WriteChunked<TImg>(image, path, chunk_slices);
+
+    auto read = ReadChunked<TImg>(path);
+    CheckPixels<TImg>(read, image->GetLargestPossibleRegion(), path + " full image");
+    for (unsigned int i = 0; i < D; i++) {
+        CHECK(read->GetSpacing()[i] == image->GetSpacing()[i], path << ": spacing " << i);
+        CHECK(read->GetOrigin()[i] == image->GetOrigin()[i], path << ": origin " << i);
+        for (unsigned int j = 0; j < D; j++) {
+            CHECK(read->GetDirection()(i, j) == image->GetDirection()(i, j),
+                  path << ": direction " << i << "," << j);
+        }
+    }
+
+    auto part = ReadChunkedRegion<TImg>(path, sub_region);
+    CheckPixels<TImg>(part, sub_region, path + " sub-region");
+    std::remove(path.c_str());
+}
+
+int main(int argc, char **argv) {
+    const std::string dir = argc > 1 ? std::string(argv[1]) + "/" : std::string();
+
+    /* 7 slices in chunks of 2 leaves a short last chunk, and the sub-region crosses chunks */
+    using Float4 = itk::Image<float, 4>;
+    Float4::RegionType float_region;
+    float_region.SetIndex({{1, 2, 1, 1}});
+    float_region.SetSize({{3, 2, 4, 1}});
+    RoundTrip<Float4>({{5, 4, 7, 3}}, 2, float_region, dir + "chunked_float4.nch");
+
+    using Complex4 = itk::Image<std::complex<float>, 4>;
+    Complex4::RegionType complex_region;
+    complex_region.SetIndex({{0, 0, 2, 0}});
+    complex_region.SetSize({{4, 3, 3, 2}});
+    RoundTrip<Complex4>({{4, 3, 5, 2}}, 3, complex_region, dir + "chunked_complex4.nch");
+
+    /* More slices per chunk than there are slices */
+    using Double3 = itk::Image<double, 3>;
+    Double3::RegionType double_region;
+    double_region.SetIndex({{2, 0, 3}});
+    double_region.SetSize({{1, 5, 2}});
+    RoundTrip<Double3>({{6, 5, 6}}, 10, double_region, dir + "chunked_double3.nch");
+
+    /* A 2D image is a single chunk */
+    using Float2 = itk::Image<float, 2>;
+    Float2::RegionType slice_region;
+    slice_region.SetIndex({{3, 1}});
+    slice_region.SetSize({{2, 2}});
+    RoundTrip<Float2>({{6, 4}}, 1, slice_region, dir + "chunked_float2.nch");
+
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All chunked round-trip checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
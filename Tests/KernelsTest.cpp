@@ -0,0 +1,128 @@
+/*
+ *  KernelsTest.cpp
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Check the conversion kernels against a plain scalar conversion, for every stored type with
+ *  and without byte-swapping, and for real and complex outputs.
+ *
+ */
+
+#include <algorithm>
+#include <complex>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Kernels.h"
+
+static int failures = 0;
+
+template <typename T> struct TypeName;
+template <> struct TypeName<uint8_t> { static constexpr const char *value = "uint8"; };
+template <> struct TypeName<int16_t> { static constexpr const char *value = "int16"; };
+template <> struct TypeName<uint16_t> { static constexpr const char *value = "uint16"; };
+template <> struct TypeName<int32_t> { static constexpr const char *value = "int32"; };
+template <> struct TypeName<float> { static constexpr const char *value = "float32"; };
+template <> struct TypeName<double> { static constexpr const char *value = "double"; };
+template <> struct TypeName<std::complex<float>> {
+    static constexpr const char *value = "complex<float>";
+};
+template <> struct TypeName<std::complex<double>> {
+    static constexpr const char *value = "complex<double>";
+};
+
+/*
+ * Stored values including the extremes of each type
+ */
+template <typename T> std::vector<T> MakeValues(const size_t n) {
+    const double lo = static_cast<double>(std::numeric_limits<T>::lowest());
+    const double hi = static_cast<double>(std::numeric_limits<T>::max());
+
+    std::mt19937                           rng(42);
+    std::uniform_real_distribution<double> dist(std::max(lo, -1.e6), std::min(hi, 1.e6));
+    std::vector<T>                         values(n);
+    for (auto &v : values) {
+        v = static_cast<T>(dist(rng));
+    }
+    if (n > 1) {
+        values[0] = std::numeric_limits<T>::lowest();
+        values[1] = std::numeric_limits<T>::max();
+    }
+    return values;
+}
+
+template <typename TIn, typename TOut>
+void Check(const size_t n, const bool swap, const double slope, const double offset) {
+    using TReal                   = typename Kernels::RealType<TOut>::type;
+    const std::vector<TIn> values = MakeValues<TIn>(n);
+
+    /* Store the values as they would be on disk, starting at an odd address */
+    std::vector<unsigned char> stored(n * sizeof(TIn) + 1);
+    for (size_t i = 0; i < n; i++) {
+        unsigned char *p = stored.data() + 1 + i * sizeof(TIn);
+        std::memcpy(p, &values[i], sizeof(TIn));
+        if (swap) {
+            std::reverse(p, p + sizeof(TIn));
+        }
+    }
+
+    std::vector<TOut> out(n, TOut(-999));
+    Kernels::ConvertScaled<TIn>(stored.data() + 1, n, swap, slope, offset, out.data());
+
+    size_t wrong = 0;
+    for (size_t i = 0; i < n; i++) {
+        const TOut expected = static_cast<TReal>(static_cast<double>(values[i]) * slope + offset);
+        if (out[i] != expected) {
+            wrong++;
+        }
+    }
+    if (wrong) {
+        std::cerr << "FAILED: " << TypeName<TIn>::value << " to " << TypeName<TOut>::value
+                  << (swap ? " swapped" : "") << ", n = " << n << ": " << wrong
+                  << " values differ" << std::endl;
+        failures++;
+    }
+}
+
+template <typename TIn, typename TOut> void CheckAll() {
+    /* Sizes around the vector widths and the blocks used for 32-bit swaps */
+    for (const size_t n : {0, 1, 3, 17, 1023, 1024, 1025, 5000}) {
+        for (const bool swap : {false, true}) {
+            Check<TIn, TOut>(n, swap, 1.0, 0.0);
+            Check<TIn, TOut>(n, swap, 0.37, -12.5);
+            Check<TIn, TOut>(n, swap, -2.5e-3, 1.e4);
+        }
+    }
+}
+
+template <typename TIn> void CheckOutputs() {
+    CheckAll<TIn, float>();
+    CheckAll<TIn, double>();
+    CheckAll<TIn, std::complex<float>>();
+    CheckAll<TIn, std::complex<double>>();
+}
+
+int main() {
+    CheckOutputs<uint8_t>();
+    CheckOutputs<int16_t>();
+    CheckOutputs<uint16_t>();
+    CheckOutputs<int32_t>();
+    CheckOutputs<float>();
+
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All kernel checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
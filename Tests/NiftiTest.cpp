@@ -0,0 +1,141 @@
+/*
+ *  NiftiTest.cpp
+ *
+ *  Copyright (c) 2017 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Write complex images with NiftiVolumeWriter and check that ITK's NIfTI reader gets back the
+ *  same geometry and pixels. The direction has a negative determinant so that qfac is tested.
+ *  Usage: test_nifti [DIR], the files are written to DIR (default the current directory).
+ *
+ */
+
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkNiftiImageIO.h"
+
+#include "Nifti.h"
+
+static int failures = 0;
+
+#define CHECK(x, msg)                                                                              \
+    if (!(x)) {                                                                                    \
+        std::cerr << "FAILED: " << msg << std::endl;                                               \
+        failures++;                                                                                \
+    }
+
+/*
+ * A different value for every pixel, so that misplaced volumes are caught
+ */
+template <typename T> std::complex<T> Value(const itk::Index<4> &index) {
+    const T v = index[0] + 10 * index[1] + 100 * index[2] + 1000 * index[3];
+    return {v, -v / 2};
+}
+
+template <typename TImg> typename TImg::Pointer MakeImage() {
+    typename TImg::SizeType size;
+    size[0] = 5;
+    size[1] = 4;
+    size[2] = 3;
+    size[3] = 2;
+    auto image = TImg::New();
+    image->SetRegions(typename TImg::RegionType(size));
+    image->Allocate();
+
+    typename TImg::SpacingType spacing;
+    typename TImg::PointType   origin;
+    for (unsigned int d = 0; d < 4; d++) {
+        spacing[d] = 0.5 + 0.25 * d;
+        origin[d]  = d < 3 ? -20.0 + 7.5 * d : 0.0;
+    }
+    /* Rotate 30 degrees about z and 20 about x, then flip the last column so the determinant is
+     * negative */
+    const double ca = std::cos(M_PI / 6), sa = std::sin(M_PI / 6);
+    const double cb = std::cos(M_PI / 9), sb = std::sin(M_PI / 9);
+    const double rotation[3][3] = {{ca, -sa * cb, sa * sb}, {sa, ca * cb, -ca * sb}, {0, sb, cb}};
+    typename TImg::DirectionType direction;
+    direction.SetIdentity();
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            direction(i, j) = j < 2 ? rotation[i][j] : -rotation[i][j];
+        }
+    }
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+
+    itk::ImageRegionIteratorWithIndex<TImg> it(image, image->GetLargestPossibleRegion());
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+        it.Set(Value<typename TImg::PixelType::value_type>(it.GetIndex()));
+    }
+    return image;
+}
+
+template <typename TImg> void RoundTrip(const std::string &path) {
+    using T                    = typename TImg::PixelType::value_type;
+    auto         image         = MakeImage<TImg>();
+    const auto   region        = image->GetLargestPossibleRegion();
+    const size_t volumes       = region.GetSize(3);
+    const size_t volume_pixels = region.GetNumberOfPixels() / volumes;
+
+    NiftiVolumeWriter<TImg> writer(image, path);
+    for (size_t v = 0; v < volumes; v++) {
+        writer.WriteVolume(image->GetBufferPointer() + v * volume_pixels);
+    }
+    writer.Close();
+
+    auto reader = itk::ImageFileReader<TImg>::New();
+    reader->SetImageIO(itk::NiftiImageIO::New());
+    reader->SetFileName(path);
+    reader->Update();
+    auto read = reader->GetOutput();
+
+    CHECK(read->GetLargestPossibleRegion() == region, path << ": size does not match");
+    for (unsigned int i = 0; i < 4; i++) {
+        CHECK(std::abs(read->GetSpacing()[i] - image->GetSpacing()[i]) < 1.e-5,
+              path << ": spacing " << i << " is " << read->GetSpacing()[i]);
+        CHECK(std::abs(read->GetOrigin()[i] - image->GetOrigin()[i]) < 1.e-4,
+              path << ": origin " << i << " is " << read->GetOrigin()[i]);
+        for (unsigned int j = 0; j < 4; j++) {
+            CHECK(std::abs(read->GetDirection()(i, j) - image->GetDirection()(i, j)) < 1.e-5,
+                  path << ": direction " << i << "," << j << " is " << read->GetDirection()(i, j));
+        }
+    }
+    if (read->GetLargestPossibleRegion() == region) {
+        size_t                                       wrong = 0;
+        itk::ImageRegionConstIteratorWithIndex<TImg> it(read, region);
+        for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+            if (it.Get() != Value<T>(it.GetIndex())) {
+                wrong++;
+            }
+        }
+        CHECK(wrong == 0, path << ": " << wrong << " pixels differ");
+    }
+    std::remove(path.c_str());
+}
+
+int main(int argc, char **argv) {
+    const std::string dir = argc > 1 ? std::string(argv[1]) + "/" : std::string();
+    RoundTrip<itk::Image<std::complex<float>, 4>>(dir + "nifti_complex_float.nii");
+    RoundTrip<itk::Image<std::complex<float>, 4>>(dir + "nifti_complex_float.nii.gz");
+    RoundTrip<itk::Image<std::complex<double>, 4>>(dir + "nifti_complex_double.nii.gz");
+
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All NIfTI round-trip checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#!/bin/bash -eu
+# Runs several nanqueue workers against a local queue and checks that every item runs exactly once,
+# that re-adding items is harmless, and that the claim of a worker that is killed outright is
+# retried by another worker while the item it was running is stopped.
+NANQUEUE="${1:-$(cd "$(dirname "${BASH_SOURCE[0]}")/../Scripts" && pwd)/nanqueue}"
+TMP="$( mktemp -d )"
+trap 'kill $( jobs -p ) 2>/dev/null || true; rm -rf "$TMP"' EXIT
+
+# Wait up to 30 seconds for a file to have contents
+function wait_for() {
+    for I in $( seq 300 ); do
+        [[ -s "$1" ]] && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+function check() {
+    if ! eval "$1"; then
+        echo "FAILED: $2"
+        exit 1
+    fi
+    echo "ok: $2"
+}
+
+# Several workers, each item records which worker ran it
+Q="$TMP/queue"
+ITEMS=20
+for I in $( seq $ITEMS ); do
+    echo "sleep 0.1; echo $I >> $TMP/ran"
+done | "$NANQUEUE" add "$Q"
+for W in 1 2 3 4; do
+    "$NANQUEUE" -p 1 work "$Q" > "$TMP/worker$W.log" &
+done
+wait
+check '[[ $( sort -n "$TMP/ran" | uniq | wc -l ) -eq $ITEMS ]]' "every item ran"
+check '[[ $( wc -l < "$TMP/ran" ) -eq $ITEMS ]]' "no item ran twice"
+check '[[ $( ls -1 "$Q/done" | wc -l ) -eq $ITEMS ]]' "every item is done"
+check '[[ $( grep -l Finished "$TMP"/worker*.log | wc -l ) -gt 1 ]]' "work was shared"
+for I in $( seq $ITEMS ); do
+    echo "sleep 0.1; echo $I >> $TMP/ran"
+done | "$NANQUEUE" add "$Q" > "$TMP/readd.log"
+check 'grep -q "Added 0 items" "$TMP/readd.log"' "re-adding finished items adds nothing"
+
+# Failing items are retried and then given up on
+Q="$TMP/failing"
+echo "echo attempt >> $TMP/failed; false" | "$NANQUEUE" add "$Q" > /dev/null
+"$NANQUEUE" -p 1 -r 3 work "$Q" > /dev/null
+check '[[ $( wc -l < "$TMP/failed" ) -eq 3 ]]' "failing item was tried three times"
+check '[[ $( ls -1 "$Q/failed" | wc -l ) -eq 1 ]]' "failing item was given up on"
+
+# The first attempt hangs in a grandchild, the worker running it is then killed with SIGKILL
+Q="$TMP/abandoned"
+echo "if [[ -e $TMP/first ]]; then echo finished > $TMP/result; else touch $TMP/first; sleep 60 & echo \$! > $TMP/sleep.pid; wait; fi" |
+    "$NANQUEUE" add "$Q" > /dev/null
+"$NANQUEUE" -p 1 -t 4 work "$Q" > "$TMP/killed.log" &
+KILLED=$!
+wait_for "$TMP/sleep.pid"
+kill -9 $KILLED
+"$NANQUEUE" -p 1 -t 4 work "$Q" > "$TMP/rescue.log" &
+check 'wait_for "$TMP/result"' "abandoned item was retried"
+check '! kill -0 $( cat "$TMP/sleep.pid" ) 2>/dev/null' "abandoned item was stopped"
+
+# A worker that is asked to stop puts its item back
+Q="$TMP/stopped"
+rm -f "$TMP/sleep.pid"
+echo "sleep 60 & echo \$! > $TMP/sleep.pid; wait" | "$NANQUEUE" add "$Q" > /dev/null
+"$NANQUEUE" -p 1 work "$Q" > /dev/null &
+STOPPED=$!
+wait_for "$TMP/sleep.pid"
+kill -TERM $STOPPED
+wait $STOPPED || true
+check '[[ $( ls -1 "$Q/todo" | wc -l ) -eq 1 ]]' "stopped worker released its claim"
+check '! kill -0 $( cat "$TMP/sleep.pid" ) 2>/dev/null' "stopped worker stopped its item"
+
+echo "All nanqueue tests passed"